@@ -0,0 +1,391 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2011
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdint.h>
+
+#include <freerdp/types.h>
+#include <freerdp/utils/stream.h>
+#include <freerdp/utils/svc_plugin.h>
+
+#include "adpcm.h"
+#include "audio.h"
+#include "service.h"
+#include "messages.h"
+
+/**
+ * The size of the per-channel header of each Microsoft ADPCM block, in bytes.
+ */
+#define MS_ADPCM_HEADER_SIZE 7
+
+/**
+ * The size of the per-channel header of each IMA ADPCM block, in bytes.
+ */
+#define IMA_ADPCM_HEADER_SIZE 4
+
+/**
+ * The standard predictor coefficient pairs used by Microsoft ADPCM. Each
+ * block selects one pair via the predictor index within its header.
+ */
+const int __ms_adpcm_coefficients[][2] = {
+    { 256,    0 },
+    { 512, -256 },
+    {   0,    0 },
+    { 192,   64 },
+    { 240,    0 },
+    { 460, -208 },
+    { 392, -232 }
+};
+
+/**
+ * The Microsoft ADPCM step size adaptation table, indexed by the unsigned
+ * value of each decoded nibble.
+ */
+const int __ms_adpcm_adaptation[] = {
+    230, 230, 230, 230, 307, 409, 512, 614,
+    768, 614, 512, 409, 307, 230, 230, 230
+};
+
+/**
+ * The IMA ADPCM step size table.
+ */
+const int __ima_adpcm_steps[] = {
+        7,     8,     9,    10,    11,    12,    13,    14,
+       16,    17,    19,    21,    23,    25,    28,    31,
+       34,    37,    41,    45,    50,    55,    60,    66,
+       73,    80,    88,    97,   107,   118,   130,   143,
+      157,   173,   190,   209,   230,   253,   279,   307,
+      337,   371,   408,   449,   494,   544,   598,   658,
+      724,   796,   876,   963,  1060,  1166,  1282,  1411,
+     1552,  1707,  1878,  2066,  2272,  2499,  2749,  3024,
+     3327,  3660,  4026,  4428,  4871,  5358,  5894,  6484,
+     7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+};
+
+/**
+ * The IMA ADPCM step index adjustment table, indexed by the magnitude bits
+ * of each decoded nibble.
+ */
+const int __ima_adpcm_index_adjust[] = {
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+/**
+ * Clamps the given value to the range of a signed 16-bit sample.
+ */
+int16_t __adpcm_clamp(int value) {
+
+    if (value < -32768) return -32768;
+    if (value >  32767) return  32767;
+
+    return value;
+
+}
+
+/**
+ * Reads a little-endian signed 16-bit value from the given buffer.
+ */
+int16_t __adpcm_read_s16(const unsigned char* data) {
+    return (int16_t) (data[0] | (data[1] << 8));
+}
+
+/**
+ * Returns the number of sample frames contained within an ADPCM block of the
+ * given size, or zero if the block is too small to contain even its header.
+ */
+int __adpcm_block_samples(int format_tag, int channels, int length) {
+
+    int header_size;
+    int initial_samples;
+
+    if (format_tag == WAVE_FORMAT_ADPCM) {
+        header_size = MS_ADPCM_HEADER_SIZE * channels;
+        initial_samples = 2;
+    }
+    else {
+        header_size = IMA_ADPCM_HEADER_SIZE * channels;
+        initial_samples = 1;
+    }
+
+    if (length < header_size)
+        return 0;
+
+    /* Each byte beyond the header holds two 4-bit samples */
+    return (length - header_size) * 2 / channels + initial_samples;
+
+}
+
+int guac_rdpsnd_adpcm_decoded_size(int format_tag, int channels,
+        int block_align, int length) {
+
+    int blocks    = length / block_align;
+    int remainder = length % block_align;
+
+    int samples =
+          blocks * __adpcm_block_samples(format_tag, channels, block_align)
+        + __adpcm_block_samples(format_tag, channels, remainder);
+
+    return samples * channels * 2;
+
+}
+
+/**
+ * Decodes a single Microsoft ADPCM block, returning the number of sample
+ * frames written.
+ */
+int __ms_adpcm_decode_block(const unsigned char* data, int length,
+        int channels, int16_t* output) {
+
+    int predictor[2];
+    int delta[2];
+    int sample1[2];
+    int sample2[2];
+
+    int channel;
+    int frames = __adpcm_block_samples(WAVE_FORMAT_ADPCM, channels, length);
+    int16_t* current = output;
+
+    if (frames == 0)
+        return 0;
+
+    /* Read block header, stored as arrays of per-channel fields */
+    for (channel=0; channel<channels; channel++) {
+
+        predictor[channel] = data[channel];
+        if (predictor[channel] > 6)
+            predictor[channel] = 0;
+
+        delta[channel]   = __adpcm_read_s16(data +     channels   + channel*2);
+        sample1[channel] = __adpcm_read_s16(data + 3 * channels   + channel*2);
+        sample2[channel] = __adpcm_read_s16(data + 5 * channels   + channel*2);
+
+    }
+
+    data   += MS_ADPCM_HEADER_SIZE * channels;
+    length -= MS_ADPCM_HEADER_SIZE * channels;
+
+    /* Header samples are stored most recent first */
+    for (channel=0; channel<channels; channel++)
+        *(current++) = sample2[channel];
+
+    for (channel=0; channel<channels; channel++)
+        *(current++) = sample1[channel];
+
+    /* Decode nibbles, high nibble first, alternating channels */
+    channel = 0;
+    while (length > 0) {
+
+        int shift;
+        for (shift=4; shift>=0; shift-=4) {
+
+            int nibble = (*data >> shift) & 0x0F;
+            int signed_nibble = (nibble & 0x08) ? nibble - 16 : nibble;
+
+            const int* coefficients = __ms_adpcm_coefficients[predictor[channel]];
+
+            int value = (sample1[channel] * coefficients[0]
+                       + sample2[channel] * coefficients[1]) / 256
+                       + signed_nibble * delta[channel];
+
+            sample2[channel] = sample1[channel];
+            sample1[channel] = __adpcm_clamp(value);
+            *(current++) = sample1[channel];
+
+            /* Adapt step size */
+            delta[channel] = (__ms_adpcm_adaptation[nibble] * delta[channel]) / 256;
+            if (delta[channel] < 16)
+                delta[channel] = 16;
+            else if (delta[channel] > 0x7FFF)
+                delta[channel] = 0x7FFF;
+
+            channel = (channel + 1) % channels;
+
+        }
+
+        data++;
+        length--;
+
+    }
+
+    return frames;
+
+}
+
+int guac_rdpsnd_ms_adpcm_decode(const unsigned char* data, int length,
+        int channels, int block_align, int16_t* output) {
+
+    int16_t* current = output;
+
+    while (length > 0) {
+
+        int block_length = length;
+        if (block_length > block_align)
+            block_length = block_align;
+
+        current += __ms_adpcm_decode_block(data, block_length, channels,
+                current) * channels;
+
+        data   += block_length;
+        length -= block_length;
+
+    }
+
+    return (current - output) * 2;
+
+}
+
+/**
+ * Decodes a single IMA ADPCM nibble, updating the given sample and step
+ * index, and returning the new sample.
+ */
+int16_t __ima_adpcm_decode_nibble(int nibble, int* sample, int* index) {
+
+    int step = __ima_adpcm_steps[*index];
+    int diff = step >> 3;
+
+    if (nibble & 0x01) diff += step >> 2;
+    if (nibble & 0x02) diff += step >> 1;
+    if (nibble & 0x04) diff += step;
+
+    if (nibble & 0x08)
+        *sample = __adpcm_clamp(*sample - diff);
+    else
+        *sample = __adpcm_clamp(*sample + diff);
+
+    /* Adjust step index */
+    *index += __ima_adpcm_index_adjust[nibble & 0x07];
+    if (*index < 0)  *index = 0;
+    if (*index > 88) *index = 88;
+
+    return *sample;
+
+}
+
+/**
+ * Decodes a single IMA ADPCM block, returning the number of sample frames
+ * written.
+ */
+int __ima_adpcm_decode_block(const unsigned char* data, int length,
+        int channels, int16_t* output) {
+
+    int sample[2];
+    int index[2];
+
+    int channel;
+    int frames = __adpcm_block_samples(WAVE_FORMAT_DVI_ADPCM, channels, length);
+    int frame = 1;
+
+    if (frames == 0)
+        return 0;
+
+    /* Read block header: initial sample and step index per channel */
+    for (channel=0; channel<channels; channel++) {
+
+        sample[channel] = __adpcm_read_s16(data + channel*4);
+        index[channel]  = data[channel*4 + 2];
+        if (index[channel] > 88)
+            index[channel] = 88;
+
+        output[channel] = sample[channel];
+
+    }
+
+    data   += IMA_ADPCM_HEADER_SIZE * channels;
+    length -= IMA_ADPCM_HEADER_SIZE * channels;
+
+    /*
+     * Data is stored as groups of four bytes (eight samples) per channel,
+     * each group for each channel in turn, low nibble first.
+     */
+    while (length > 0) {
+
+        for (channel=0; channel<channels && length > 0; channel++) {
+
+            int i;
+            int group_length = length < 4 ? length : 4;
+
+            for (i=0; i<group_length*2; i++) {
+
+                int nibble = (data[i/2] >> ((i & 1) * 4)) & 0x0F;
+
+                /* Ignore samples of a truncated final group */
+                if (frame + i >= frames)
+                    break;
+
+                output[(frame + i) * channels + channel] =
+                    __ima_adpcm_decode_nibble(nibble,
+                            &(sample[channel]), &(index[channel]));
+
+            }
+
+            data   += group_length;
+            length -= group_length;
+
+        }
+
+        frame += 8;
+
+    }
+
+    return frames;
+
+}
+
+int guac_rdpsnd_ima_adpcm_decode(const unsigned char* data, int length,
+        int channels, int block_align, int16_t* output) {
+
+    int16_t* current = output;
+
+    while (length > 0) {
+
+        int block_length = length;
+        if (block_length > block_align)
+            block_length = block_align;
+
+        current += __ima_adpcm_decode_block(data, block_length, channels,
+                current) * channels;
+
+        data   += block_length;
+        length -= block_length;
+
+    }
+
+    return (current - output) * 2;
+
+}
+
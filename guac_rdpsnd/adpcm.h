@@ -0,0 +1,89 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2011
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef __GUAC_RDPSND_ADPCM_H
+#define __GUAC_RDPSND_ADPCM_H
+
+#include <stdint.h>
+
+/**
+ * Returns the number of bytes of 16-bit PCM which will be produced by
+ * decoding the given number of bytes of ADPCM data, where the data consists
+ * of blocks of the given size.
+ *
+ * @param format_tag The WAVE format tag of the ADPCM data, either
+ *                   WAVE_FORMAT_ADPCM or WAVE_FORMAT_DVI_ADPCM.
+ * @param channels The number of channels in the ADPCM data.
+ * @param block_align The size of each ADPCM block, in bytes.
+ * @param length The number of bytes of ADPCM data.
+ * @return The number of bytes of 16-bit PCM the data will decode to.
+ */
+int guac_rdpsnd_adpcm_decoded_size(int format_tag, int channels,
+        int block_align, int length);
+
+/**
+ * Decodes the given Microsoft ADPCM data into interleaved, signed 16-bit
+ * PCM, returning the number of bytes of PCM written. The output buffer must
+ * be at least as large as the size given by guac_rdpsnd_adpcm_decoded_size().
+ *
+ * @param data The Microsoft ADPCM data to decode.
+ * @param length The number of bytes of data to decode.
+ * @param channels The number of channels in the data (1 or 2).
+ * @param block_align The size of each ADPCM block, in bytes.
+ * @param output The buffer to store decoded PCM samples within.
+ * @return The number of bytes of PCM written.
+ */
+int guac_rdpsnd_ms_adpcm_decode(const unsigned char* data, int length,
+        int channels, int block_align, int16_t* output);
+
+/**
+ * Decodes the given IMA (DVI) ADPCM data into interleaved, signed 16-bit
+ * PCM, returning the number of bytes of PCM written. The output buffer must
+ * be at least as large as the size given by guac_rdpsnd_adpcm_decoded_size().
+ *
+ * @param data The IMA ADPCM data to decode.
+ * @param length The number of bytes of data to decode.
+ * @param channels The number of channels in the data (1 or 2).
+ * @param block_align The size of each ADPCM block, in bytes.
+ * @param output The buffer to store decoded PCM samples within.
+ * @return The number of bytes of PCM written.
+ */
+int guac_rdpsnd_ima_adpcm_decode(const unsigned char* data, int length,
+        int channels, int block_align, int16_t* output);
+
+#endif
+
@@ -36,6 +36,7 @@
  * ***** END LICENSE BLOCK ***** */
 
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <freerdp/constants.h>
@@ -45,6 +46,7 @@
 
 #include <guacamole/client.h>
 
+#include "adpcm.h"
 #include "audio.h"
 #include "service.h"
 #include "messages.h"
@@ -59,6 +61,8 @@ void guac_rdpsnd_formats_handler(guac_rdpsndPlugin* rdpsnd,
     int server_format_count;
     int server_version;
     int i;
+    int pass;
+    unsigned char* formats_start;
 
     STREAM* output_stream;
     int output_body_size;
@@ -93,54 +97,88 @@ void guac_rdpsnd_formats_handler(guac_rdpsndPlugin* rdpsnd,
     /* Fill in format count later */
     stream_seek_UINT16(output_stream); /* offset = 0x12 */
 
-    /* Version and padding */
+    /* Version and padding. Version 8 allows the server to send Wave2 PDUs */
     stream_write_BYTE(output_stream,  0);
-    stream_write_UINT16(output_stream, 6);
+    stream_write_UINT16(output_stream, 8);
     stream_write_BYTE(output_stream,  0);
 
-    /* Check each server format, respond if supported */
-    for (i=0; i < server_format_count; i++) {
+    /* Remember start of server formats */
+    stream_get_mark(input_stream, formats_start);
 
-        unsigned char* format_start;
+    /* Check each server format, respond if supported, first accepting those
+     * which can be encoded without conversion, and preferring compressed
+     * formats within each of those groups */
+    for (pass=0; pass<4; pass++) {
 
-        int format_tag;
-        int channels;
-        int rate;
-        int bps;
-        int body_size;
+        int native     = (pass < 2);
+        int compressed = (pass % 2 == 0);
 
-        /* Remember position in stream */
-        stream_get_mark(input_stream, format_start);
+        stream_set_mark(input_stream, formats_start);
 
-        /* Read format */
-        stream_read_UINT16(input_stream, format_tag);
-        stream_read_UINT16(input_stream, channels);
-        stream_read_UINT32(input_stream, rate);
-        stream_seek_UINT32(input_stream);
-        stream_seek_UINT16(input_stream);
-        stream_read_UINT16(input_stream, bps);
+        for (i=0; i < server_format_count; i++) {
 
-        /* Skip past extra data */
-        stream_read_UINT16(input_stream, body_size);
-        stream_seek(input_stream, body_size);
+            unsigned char* format_start;
 
-        /* If PCM, accept */
-        if (format_tag == WAVE_FORMAT_PCM) {
+            int format_tag;
+            int channels;
+            int rate;
+            int block_align;
+            int bps;
+            int body_size;
+
+            const char* format_name;
+
+            /* Remember position in stream */
+            stream_get_mark(input_stream, format_start);
+
+            /* Read format */
+            stream_read_UINT16(input_stream, format_tag);
+            stream_read_UINT16(input_stream, channels);
+            stream_read_UINT32(input_stream, rate);
+            stream_seek_UINT32(input_stream);
+            stream_read_UINT16(input_stream, block_align);
+            stream_read_UINT16(input_stream, bps);
+
+            /* Skip past extra data */
+            stream_read_UINT16(input_stream, body_size);
+            stream_seek(input_stream, body_size);
+
+            /* Only PCM and mono or stereo ADPCM are supported */
+            if (format_tag == WAVE_FORMAT_PCM)
+                format_name = "PCM";
+
+            else if (format_tag == WAVE_FORMAT_ADPCM
+                    && channels >= 1 && channels <= 2 && block_align > 0)
+                format_name = "MS ADPCM";
+
+            else if (format_tag == WAVE_FORMAT_DVI_ADPCM
+                    && channels >= 1 && channels <= 2 && block_align > 0)
+                format_name = "IMA ADPCM";
+
+            else
+                continue;
+
+            /* Consider each format only in its own pass */
+            if (audio_stream_format_native(audio, rate, channels) != native
+                    || (format_tag != WAVE_FORMAT_PCM) != compressed)
+                continue;
 
             /* If can fit another format, accept it */
             if (rdpsnd->format_count < GUAC_RDP_MAX_FORMATS) {
 
                 /* Add channel */
                 int current = rdpsnd->format_count++;
-                rdpsnd->formats[current].rate     = rate;
-                rdpsnd->formats[current].channels = channels;
-                rdpsnd->formats[current].bps      = bps;
+                rdpsnd->formats[current].format_tag  = format_tag;
+                rdpsnd->formats[current].block_align = block_align;
+                rdpsnd->formats[current].rate        = rate;
+                rdpsnd->formats[current].channels    = channels;
+                rdpsnd->formats[current].bps         = bps;
 
                 /* Log format */
                 guac_client_log_info(audio->client,
-                        "Accepted format: %i-bit PCM with %i channels at "
+                        "Accepted format: %i-bit %s with %i channels at "
                         "%i Hz",
-                        bps, channels, rate);
+                        bps, format_name, channels, rate);
 
                 /* Queue format for sending as accepted */
                 stream_check_size(output_stream, 18 + body_size);
@@ -156,9 +194,9 @@ void guac_rdpsnd_formats_handler(guac_rdpsndPlugin* rdpsnd,
             /* Otherwise, log that we dropped one */
             else
                 guac_client_log_info(audio->client,
-                        "Dropped valid format: %i-bit PCM with %i channels at "
+                        "Dropped valid format: %i-bit %s with %i channels at "
                         "%i Hz",
-                        bps, channels, rate);
+                        bps, format_name, channels, rate);
 
         }
 
@@ -234,15 +272,23 @@ void guac_rdpsnd_wave_info_handler(guac_rdpsndPlugin* rdpsnd,
         audio_stream* audio, STREAM* input_stream,
         guac_rdpsnd_pdu_header* header) {
 
-    unsigned char buffer[4];
     int format;
 
+    /* Drop PDUs too short to contain wave information */
+    if (header->body_size < 12
+            || (int) stream_get_left(input_stream) < 12) {
+        guac_client_log_info(audio->client,
+                "Ignoring malformed WaveInfo PDU (%i bytes).",
+                header->body_size);
+        return;
+    }
+
     /* Read wave information */
     stream_read_UINT16(input_stream, rdpsnd->server_timestamp);
     stream_read_UINT16(input_stream, format);
     stream_read_BYTE(input_stream, rdpsnd->waveinfo_block_number);
     stream_seek(input_stream, 3);
-    stream_read(input_stream, buffer, 4);
+    stream_read(input_stream, rdpsnd->waveinfo_data, 4);
 
     /*
      * Size of incoming wave data is equal to the body size field of this
@@ -253,21 +299,17 @@ void guac_rdpsnd_wave_info_handler(guac_rdpsndPlugin* rdpsnd,
 
     /* Read wave in next iteration */
     rdpsnd->next_pdu_is_wave = TRUE;
-
-    /* Init stream with requested format */
-    audio_stream_begin(audio,
-            rdpsnd->formats[format].rate,
-            rdpsnd->formats[format].channels,
-            rdpsnd->formats[format].bps);
-
-    /* Write initial 4 bytes of data */
-    audio_stream_write_pcm(audio, buffer, 4);
+    rdpsnd->waveinfo_format = format;
 
 }
 
-void guac_rdpsnd_wave_handler(guac_rdpsndPlugin* rdpsnd,
-        audio_stream* audio, STREAM* input_stream,
-        guac_rdpsnd_pdu_header* header) {
+/**
+ * Decodes and queues the given block of wave data having the given format,
+ * and confirms its receipt to the server. The wave data may be modified.
+ */
+void __guac_rdpsnd_process_wave(guac_rdpsndPlugin* rdpsnd,
+        audio_stream* audio, int format_index, unsigned char* buffer,
+        int length, int timestamp, int block_number) {
 
     rdpSvcPlugin* plugin = (rdpSvcPlugin*)rdpsnd;
 
@@ -277,19 +319,71 @@ void guac_rdpsnd_wave_handler(guac_rdpsndPlugin* rdpsnd,
     /* Wave Confirmation PDU */
     STREAM* output_stream = stream_new(8);
 
-    /* Get wave data */
-    unsigned char* buffer = stream_get_head(input_stream) + 4;
+    /* Ignore data of formats never agreed upon (but still confirm) */
+    if (format_index >= 0 && format_index < rdpsnd->format_count) {
+
+        guac_pcm_format* format = &(rdpsnd->formats[format_index]);
+
+        /*
+         * Queue audio for encoding only if not silent. Silent blocks must
+         * still be confirmed below, or the server will stop sending audio.
+         */
+        if (format->format_tag == WAVE_FORMAT_PCM) {
+
+            /* The wave data belongs to FreeRDP, so must be copied */
+            if (!audio_pcm_silent(buffer, length, format->bps)
+                    && audio_stream_queue_pcm(audio, format->rate,
+                        format->channels, format->bps, buffer, length))
+                guac_client_log_info(audio->client,
+                        "Audio encoder is behind. Dropped %i bytes of audio.",
+                        length);
+
+        }
+
+        /* Decode ADPCM to 16-bit PCM directly into the queue */
+        else {
+
+            int pcm_length = 0;
+            unsigned char* pcm = audio_stream_reserve_pcm(audio,
+                    guac_rdpsnd_adpcm_decoded_size(format->format_tag,
+                        format->channels, format->block_align, length));
+
+            if (pcm == NULL) {
+                guac_client_log_info(audio->client,
+                        "Audio encoder is behind. Dropped %i bytes of audio.",
+                        length);
+            }
+
+            else {
+
+                if (format->format_tag == WAVE_FORMAT_ADPCM)
+                    pcm_length = guac_rdpsnd_ms_adpcm_decode(buffer, length,
+                            format->channels, format->block_align,
+                            (int16_t*) pcm);
+                else
+                    pcm_length = guac_rdpsnd_ima_adpcm_decode(buffer, length,
+                            format->channels, format->block_align,
+                            (int16_t*) pcm);
+
+                if (audio_pcm_silent(pcm, pcm_length, 16))
+                    pcm_length = 0;
+
+                /* A zero length releases the reserved chunk unqueued */
+                audio_stream_queue_reserved(audio, format->rate,
+                        format->channels, 16, pcm_length);
+
+            }
+
+        }
 
-    /* Write rest of audio packet */
-    audio_stream_write_pcm(audio, buffer, rdpsnd->incoming_wave_size);
-    audio_stream_end(audio);
+    }
 
     /* Write Wave Confirmation PDU */
     stream_write_BYTE(output_stream, SNDC_WAVECONFIRM);
     stream_write_BYTE(output_stream, 0);
     stream_write_UINT16(output_stream, 4);
-    stream_write_UINT16(output_stream, rdpsnd->server_timestamp);
-    stream_write_BYTE(output_stream, rdpsnd->waveinfo_block_number);
+    stream_write_UINT16(output_stream, timestamp);
+    stream_write_BYTE(output_stream, block_number);
     stream_write_BYTE(output_stream, 0);
 
     /* Send Wave Confirmation PDU */
@@ -297,9 +391,74 @@ void guac_rdpsnd_wave_handler(guac_rdpsndPlugin* rdpsnd,
     svc_plugin_send(plugin, output_stream);
     pthread_mutex_unlock(&(guac_client_data->rdp_lock));
 
+}
+
+void guac_rdpsnd_wave_handler(guac_rdpsndPlugin* rdpsnd,
+        audio_stream* audio, STREAM* input_stream,
+        guac_rdpsnd_pdu_header* header) {
+
+    unsigned char* buffer;
+
     /* We no longer expect to receive wave data */
     rdpsnd->next_pdu_is_wave = FALSE;
 
+    /* Drop Wave PDUs shorter than announced by their WaveInfo PDU. The four
+     * bytes parsed as a header are the first four bytes of the PDU. */
+    if ((int) stream_get_left(input_stream) < rdpsnd->incoming_wave_size) {
+        guac_client_log_info(audio->client,
+                "Ignoring truncated Wave PDU (expected %i bytes).",
+                rdpsnd->incoming_wave_size + 4);
+        return;
+    }
+
+    /*
+     * Get wave data. The Wave PDU begins with four bytes of padding in place
+     * of the four bytes sent within the WaveInfo PDU, which are restored here
+     * such that the wave data is contiguous.
+     */
+    buffer = stream_get_head(input_stream);
+    memcpy(buffer, rdpsnd->waveinfo_data, 4);
+
+    __guac_rdpsnd_process_wave(rdpsnd, audio, rdpsnd->waveinfo_format,
+            buffer, rdpsnd->incoming_wave_size + 4,
+            rdpsnd->server_timestamp, rdpsnd->waveinfo_block_number);
+
+}
+
+void guac_rdpsnd_wave2_handler(guac_rdpsndPlugin* rdpsnd,
+        audio_stream* audio, STREAM* input_stream,
+        guac_rdpsnd_pdu_header* header) {
+
+    int format;
+    int block_number;
+
+    /* Drop PDUs too short for their wave information, or shorter than
+     * their declared size */
+    if (header->body_size < 12
+            || (int) stream_get_left(input_stream) < header->body_size) {
+        guac_client_log_info(audio->client,
+                "Ignoring malformed Wave2 PDU (%i bytes).",
+                header->body_size);
+        return;
+    }
+
+    /* Read wave information */
+    stream_read_UINT16(input_stream, rdpsnd->server_timestamp);
+    stream_read_UINT16(input_stream, format);
+    stream_read_BYTE(input_stream, block_number);
+    stream_seek(input_stream, 3);
+
+    /*
+     * Skip the audio timestamp. Guacamole audio instructions are played as
+     * they are received, and have no field which could carry it.
+     */
+    stream_seek_UINT32(input_stream);
+
+    /* Wave data is the remainder of the PDU, following the 12 bytes above */
+    __guac_rdpsnd_process_wave(rdpsnd, audio, format,
+            stream_get_tail(input_stream), header->body_size - 12,
+            rdpsnd->server_timestamp, block_number);
+
 }
 
 void guac_rdpsnd_close_handler(guac_rdpsndPlugin* rdpsnd,
@@ -76,6 +76,13 @@
  */
 #define SNDC_QUALITYMODE   12
 
+/**
+ * Wave2 PDU. This PDU contains both the information of a WaveInfo PDU and
+ * all wave data, and is sent instead of WaveInfo and Wave PDUs if both
+ * server and client are at least version 8.
+ */
+#define SNDC_WAVE2         26
+
 /*
  * Quality Modes
  */
@@ -104,7 +111,9 @@
 /*
  * Sound Formats
  */
-#define WAVE_FORMAT_PCM  1
+#define WAVE_FORMAT_PCM       0x0001
+#define WAVE_FORMAT_ADPCM     0x0002
+#define WAVE_FORMAT_DVI_ADPCM 0x0011
 
 /**
  * The header common to all RDPSND PDUs.
@@ -151,6 +160,13 @@ void guac_rdpsnd_wave_handler(guac_rdpsndPlugin* rdpsnd,
         audio_stream* audio, STREAM* input_stream,
         guac_rdpsnd_pdu_header* header);
 
+/**
+ * Handler for the SNDC_WAVE2 (Wave2) PDU.
+ */
+void guac_rdpsnd_wave2_handler(guac_rdpsndPlugin* rdpsnd,
+        audio_stream* audio, STREAM* input_stream,
+        guac_rdpsnd_pdu_header* header);
+
 /**
  * Handler for the SNDC_CLOSE (Close) PDU.
  */
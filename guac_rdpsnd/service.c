@@ -142,6 +142,12 @@ void guac_rdpsnd_process_receive(rdpSvcPlugin* plugin,
                     input_stream, &header);
             break;
 
+        /* Wave2 PDU */
+        case SNDC_WAVE2:
+            guac_rdpsnd_wave2_handler(rdpsnd, audio,
+                    input_stream, &header);
+            break;
+
         /* Close PDU */
         case SNDC_CLOSE:
             guac_rdpsnd_close_handler(rdpsnd, audio,
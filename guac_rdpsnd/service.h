@@ -46,11 +46,24 @@
 
 
 /**
- * Abstract representation of a PCM format, including the sample rate, number
- * of channels, and bits per sample.
+ * Abstract representation of an audio format, including the WAVE format tag,
+ * sample rate, number of channels, and bits per sample.
  */
 typedef struct guac_pcm_format {
 
+    /**
+     * The WAVE format tag of this format. This will be WAVE_FORMAT_PCM for
+     * uncompressed audio, or one of the ADPCM format tags if audio must be
+     * decoded before being written to the audio stream.
+     */
+    int format_tag;
+
+    /**
+     * The size of each block of audio data, in bytes. ADPCM audio is always
+     * decoded one full block at a time.
+     */
+    int block_align;
+
     /**
      * The sample rate of this PCM format.
      */
@@ -63,8 +76,8 @@ typedef struct guac_pcm_format {
     int channels;
 
     /**
-     * The number of bits per sample within this PCM format. This should be
-     * either 8 or 16.
+     * The number of bits per sample within this format. This should be
+     * either 8 or 16 for PCM, or 4 for ADPCM.
      */
     int bps;
 
@@ -100,6 +113,17 @@ typedef struct guac_rdpsndPlugin {
      */
     int incoming_wave_size;
 
+    /**
+     * The first four bytes of wave data, which are sent within the WaveInfo
+     * PDU rather than the Wave PDU which follows it.
+     */
+    unsigned char waveinfo_data[4];
+
+    /**
+     * The index of the format of the coming wave data.
+     */
+    int waveinfo_format;
+
     /**
      * The last received server timestamp.
      */
@@ -107,8 +131,9 @@ typedef struct guac_rdpsndPlugin {
 
     /**
      * All formats agreed upon by server and client during the initial format
-     * exchange. All of these formats will be PCM, which is the only format
-     * guaranteed to be supported (based on the official RDP documentation).
+     * exchange. These formats will be PCM, which is the only format
+     * guaranteed to be supported (based on the official RDP documentation),
+     * or ADPCM, which is decoded to PCM as it is received.
      */
     guac_pcm_format formats[GUAC_RDP_MAX_FORMATS];
 
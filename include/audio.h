@@ -38,9 +38,49 @@
 #ifndef __GUAC_TEST_AUDIO_H
 #define __GUAC_TEST_AUDIO_H
 
+#include <pthread.h>
+
 #include <guacamole/client.h>
 #include <guacamole/stream.h>
 
+#include "audio_resampler.h"
+
+/**
+ * The default relative quality of encoded audio.
+ */
+#define GUAC_AUDIO_DEFAULT_QUALITY 0.4
+
+/**
+ * The largest amplitude of a 16-bit PCM sample which is still considered
+ * silent. Some audio drivers add low-level dither to otherwise silent
+ * output.
+ */
+#define GUAC_AUDIO_SILENCE_THRESHOLD 16
+
+/**
+ * The default amount of audio gathered into each audio instruction, in
+ * milliseconds.
+ */
+#define GUAC_AUDIO_DEFAULT_LATENCY 60
+
+/**
+ * The amount of audio gathered into each audio instruction while the user is
+ * interacting, in milliseconds, if less than the configured latency.
+ */
+#define GUAC_AUDIO_INTERACTIVE_LATENCY 20
+
+/**
+ * The number of milliseconds after the most recent input from the user
+ * during which the user is considered to be interacting.
+ */
+#define GUAC_AUDIO_INTERACTIVE_TIMEOUT 1000
+
+/**
+ * The maximum number of PCM chunks which may be waiting for the encoder
+ * thread. Chunks queued beyond this are dropped.
+ */
+#define GUAC_AUDIO_QUEUE_SIZE 8
+
 typedef struct audio_stream audio_stream;
 
 /**
@@ -53,6 +93,11 @@ typedef void audio_encoder_begin_handler(audio_stream* audio);
  */
 typedef void audio_encoder_end_handler(audio_stream* audio);
 
+/**
+ * Handler which is called when the audio stream is freed.
+ */
+typedef void audio_encoder_free_handler(audio_stream* audio);
+
 /**
  * Handler which is called when the audio stream is flushed.
  */
@@ -85,32 +130,65 @@ typedef struct audio_encoder {
      */
     audio_encoder_end_handler* end_handler;
 
+    /**
+     * Handler which will be called when the audio stream is freed, if any.
+     * Encoders which keep state across audio chunks free that state here.
+     */
+    audio_encoder_free_handler* free_handler;
+
 } audio_encoder;
 
 /**
- * Basic audio stream. PCM data is added to the stream. When the stream is
- * flushed, a write handler receives PCM data packets and, presumably, streams
- * them to the guac_stream provided.
+ * A chunk of PCM data waiting to be encoded by the encoder thread of an
+ * audio stream, along with its format.
  */
-struct audio_stream {
+typedef struct audio_chunk {
+
+    /**
+     * The sample rate of the PCM data.
+     */
+    int rate;
 
     /**
-     * PCM data buffer, 16-bit samples, 2-channel, 44100 Hz.
+     * The number of channels of the PCM data.
      */
-    unsigned char* pcm_data;
+    int channels;
 
     /**
-     * Number of bytes in buffer.
+     * The number of bits per sample of the PCM data.
      */
-    int used;
+    int bps;
 
     /**
-     * Maximum number of bytes in buffer.
+     * The PCM data of this chunk, allocated from the buffer pool. The buffer
+     * remains with the chunk after it is encoded, and is reused when the
+     * chunk is next queued, until the encoder thread becomes idle.
+     */
+    unsigned char* data;
+
+    /**
+     * The number of bytes of PCM data in this chunk.
      */
     int length;
 
     /**
-     * Encoded audio data buffer, as written by the encoder.
+     * The allocated size of the data buffer, in bytes.
+     */
+    int size;
+
+} audio_chunk;
+
+/**
+ * Basic audio stream. PCM data is added to the stream. When the stream is
+ * flushed, a write handler receives PCM data packets and, presumably, streams
+ * them to the guac_stream provided.
+ */
+struct audio_stream {
+
+    /**
+     * Encoded audio data buffer, as written by the encoder. This buffer is
+     * allocated from the buffer pool when first needed, and returned while
+     * the stream is idle.
      */
     unsigned char* encoded_data;
 
@@ -141,47 +219,136 @@ struct audio_stream {
     guac_stream* stream;
 
     /**
-     * The number of samples per second of PCM data sent to this stream.
+     * The number of samples per second of PCM data sent to the encoder.
      */
     int rate;
 
     /**
-     * The number of audio channels per sample of PCM data. Legal values are
-     * 1 or 2.
+     * The number of audio channels per sample of PCM data sent to the
+     * encoder.
      */
     int channels;
 
     /**
-     * The number of bits per sample per channel for PCM data. Legal values are
-     * 8 or 16.
+     * The number of bits per sample per channel for PCM data sent to the
+     * encoder. Legal values are 8 or 16.
      */
     int bps;
 
+    /**
+     * The maximum sample rate of PCM data sent to the encoder, or zero if
+     * PCM data should be encoded at its original rate.
+     */
+    int max_rate;
+
+    /**
+     * The maximum number of channels of PCM data sent to the encoder, or zero
+     * if PCM data should be encoded with its original channels.
+     */
+    int max_channels;
+
+    /**
+     * Resampler converting PCM data written to this stream to the format
+     * sent to the encoder, or NULL if never needed.
+     */
+    audio_resampler* resampler;
+
+    /**
+     * Non-zero if PCM data of the current chunk must pass through the
+     * resampler.
+     */
+    int resampling;
+
     /**
      * The number of PCM bytes written since the audio chunk began.
      */
     int pcm_bytes_written;
 
+    /**
+     * The relative quality at which audio should be encoded, from 0.0
+     * (lowest bitrate) to 1.0 (highest bitrate). Encoders read this value
+     * when each audio chunk begins.
+     */
+    double quality;
+
+    /**
+     * The amount of audio to gather into each audio instruction, in
+     * milliseconds. Audio is sent early if this much time passes without
+     * enough audio being received. If zero, each PCM chunk is sent as soon
+     * as it is encoded.
+     */
+    int latency;
+
     /**
      * Encoder-specific state data.
      */
     void* data;
 
+    /**
+     * Thread which encodes and sends queued PCM chunks.
+     */
+    pthread_t encoder_thread;
+
+    /**
+     * Lock guarding the chunk queue and the stopping flag.
+     */
+    pthread_mutex_t queue_lock;
+
+    /**
+     * Condition signalled when a chunk is queued or the stream is stopping.
+     */
+    pthread_cond_t queue_changed;
+
+    /**
+     * Ring of PCM chunks waiting to be encoded.
+     */
+    audio_chunk queue[GUAC_AUDIO_QUEUE_SIZE];
+
+    /**
+     * The index of the oldest chunk within the queue.
+     */
+    int queue_head;
+
+    /**
+     * The number of chunks within the queue, including any chunk currently
+     * being encoded.
+     */
+    int queue_length;
+
+    /**
+     * Non-zero while the producer is filling the chunk following the last
+     * queued chunk, which must keep its buffer until queued.
+     */
+    int queue_filling;
+
+    /**
+     * Non-zero if the encoder thread should exit.
+     */
+    int stopping;
+
 };
 
 /**
- * Allocates a new audio stream.
+ * Allocates a new audio stream, starting its encoder thread.
  */
 audio_stream* audio_stream_alloc(guac_client* client,
         audio_encoder* encoder);
 
 /**
- * Frees the given audio stream.
+ * Frees the given audio stream, stopping its encoder thread. Any chunks
+ * still queued are discarded.
  */
 void audio_stream_free(audio_stream* stream);
 
 /**
- * Begins a new audio stream.
+ * Returns whether PCM data of the given format can be sent to the encoder of
+ * the given audio stream without conversion.
+ */
+int audio_stream_format_native(audio_stream* audio, int rate, int channels);
+
+/**
+ * Begins a new audio stream. If the given format exceeds the maximum rate
+ * or channels of the stream, PCM data will be converted before encoding.
  */
 void audio_stream_begin(audio_stream* stream, int rate, int channels, int bps);
 
@@ -191,15 +358,56 @@ void audio_stream_begin(audio_stream* stream, int rate, int channels, int bps);
 void audio_stream_end(audio_stream* stream);
 
 /**
- * Writes PCM data to the given audio stream.
+ * Writes PCM data to the given audio stream. The data is passed directly to
+ * the encoder, which consumes it in place; it is not buffered.
  */
 void audio_stream_write_pcm(audio_stream* stream,
         unsigned char* data, int length);
 
 /**
- * Flushes the given audio stream.
+ * Returns whether the given PCM data, having the given number of bits per
+ * sample, is silent, in which case it need not be encoded or sent at all.
+ * Unsigned 8-bit samples are silent only at their midpoint (128), while
+ * signed 16-bit samples are silent if no larger in magnitude than
+ * GUAC_AUDIO_SILENCE_THRESHOLD.
+ */
+int audio_pcm_silent(const unsigned char* data, int length, int bps);
+
+/**
+ * Returns a buffer of at least the given size within the next free chunk of
+ * the queue of the given audio stream, such that PCM data can be produced
+ * directly within the queue rather than copied into it. The chunk must then
+ * be queued with audio_stream_queue_reserved() before any other chunk is
+ * reserved or queued. If the queue is full, or the buffer cannot be
+ * allocated, NULL is returned.
+ */
+unsigned char* audio_stream_reserve_pcm(audio_stream* audio, int length);
+
+/**
+ * Queues the chunk most recently reserved with audio_stream_reserve_pcm(),
+ * containing the given number of bytes of PCM data of the given format, to
+ * be encoded by the encoder thread. If the length is zero, the chunk is
+ * released without being queued.
+ */
+void audio_stream_queue_reserved(audio_stream* audio, int rate, int channels,
+        int bps, int length);
+
+/**
+ * Copies the given PCM data into the queue of the given audio stream, to be
+ * encoded by the encoder thread, returning immediately. The encoder thread
+ * gathers consecutive chunks into audio instructions according to the
+ * latency of the stream. If the queue is full, the data is dropped and non-zero is
+ * returned.
+ */
+int audio_stream_queue_pcm(audio_stream* audio, int rate, int channels,
+        int bps, unsigned char* data, int length);
+
+/**
+ * Reserves the given number of bytes at the end of the encoded_data buffer
+ * within the given audio stream, to be filled in by the encoder later. The
+ * reserved bytes are not initialized.
  */
-void audio_stream_flush(audio_stream* stream);
+void audio_stream_reserve_encoded(audio_stream* audio, int length);
 
 /**
  * Appends arbitrarily-encoded data to the encoded_data buffer
@@ -0,0 +1,187 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef __GUAC_AUDIO_RESAMPLER_H
+#define __GUAC_AUDIO_RESAMPLER_H
+
+#include <stdint.h>
+
+/**
+ * The maximum number of channels which a resampler may produce.
+ */
+#define AUDIO_RESAMPLER_MAX_CHANNELS 8
+
+/**
+ * The maximum number of input frames averaged by the low-pass filter applied
+ * when downsampling.
+ */
+#define AUDIO_RESAMPLER_MAX_TAPS 16
+
+/**
+ * Converts PCM data between sample rates and channel counts, producing
+ * signed 16-bit PCM. Resampling is by linear interpolation, and state is
+ * kept between calls, such that consecutive blocks of PCM data are
+ * resampled as one continuous stream. When downsampling, input is first
+ * low-pass filtered by averaging over roughly one output frame, such that
+ * frequencies the output cannot represent do not alias.
+ */
+typedef struct audio_resampler {
+
+    /**
+     * The sample rate of input PCM data.
+     */
+    int in_rate;
+
+    /**
+     * The number of channels of input PCM data.
+     */
+    int in_channels;
+
+    /**
+     * The number of bits per sample of input PCM data. Legal values are 8
+     * or 16.
+     */
+    int in_bps;
+
+    /**
+     * The sample rate of output PCM data.
+     */
+    int out_rate;
+
+    /**
+     * The number of channels of output PCM data. Input channels are
+     * averaged if downmixing to mono, and otherwise mapped to output
+     * channels in order.
+     */
+    int out_channels;
+
+    /**
+     * The number of input frames averaged by the low-pass filter, or 1 if
+     * input is not filtered.
+     */
+    int taps;
+
+    /**
+     * The most recent input frames, already mapped to output channels, as
+     * a ring of taps entries.
+     */
+    int history[AUDIO_RESAMPLER_MAX_TAPS][AUDIO_RESAMPLER_MAX_CHANNELS];
+
+    /**
+     * The index of the oldest entry within the history ring.
+     */
+    int history_index;
+
+    /**
+     * The sum of each channel over all entries within the history ring.
+     */
+    int sum[AUDIO_RESAMPLER_MAX_CHANNELS];
+
+    /**
+     * The number of input frames per output frame, as 16.16 fixed point.
+     */
+    uint32_t step;
+
+    /**
+     * The position of the next output frame, as 16.16 fixed point, relative
+     * to the last input frame of the previous call.
+     */
+    uint64_t position;
+
+    /**
+     * The last input frame of the previous call, already mapped to output
+     * channels.
+     */
+    int last[AUDIO_RESAMPLER_MAX_CHANNELS];
+
+    /**
+     * Buffer receiving input frames mapped to output channels and filtered,
+     * prior to interpolation.
+     */
+    int* mapped;
+
+    /**
+     * The size of the mapped frame buffer, in frames.
+     */
+    int mapped_length;
+
+    /**
+     * Buffer receiving output PCM data.
+     */
+    unsigned char* buffer;
+
+    /**
+     * The size of the output buffer, in bytes.
+     */
+    int buffer_length;
+
+} audio_resampler;
+
+/**
+ * Allocates a new resampler. The resampler must be given a format with
+ * audio_resampler_set_format() before use.
+ */
+audio_resampler* audio_resampler_alloc();
+
+/**
+ * Frees the given resampler.
+ */
+void audio_resampler_free(audio_resampler* resampler);
+
+/**
+ * Sets the input and output formats of the given resampler. If the formats
+ * differ from those previously set, the state of the resampler is reset.
+ * The number of output channels must not exceed
+ * AUDIO_RESAMPLER_MAX_CHANNELS.
+ */
+void audio_resampler_set_format(audio_resampler* resampler,
+        int in_rate, int in_channels, int in_bps,
+        int out_rate, int out_channels);
+
+/**
+ * Converts the given input PCM data, storing a pointer to the resulting
+ * signed 16-bit PCM data in output. The output data remains valid until the
+ * next call to this function.
+ *
+ * @return The number of bytes of output PCM data, or -1 if memory for the
+ *         output could not be allocated.
+ */
+int audio_resampler_convert(audio_resampler* resampler,
+        const unsigned char* data, int length, unsigned char** output);
+
+#endif
+
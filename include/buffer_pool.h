@@ -0,0 +1,85 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef _GUAC_RDP_BUFFER_POOL_H
+#define _GUAC_RDP_BUFFER_POOL_H
+
+/**
+ * The size of the smallest buffer size class, in bytes. Each following size
+ * class is twice the size of the last.
+ */
+#define GUAC_RDP_BUFFER_POOL_MIN_SIZE 4096
+
+/**
+ * The number of size classes. Buffers larger than the largest size class
+ * (1 MB) are allocated and freed directly, and never pooled.
+ */
+#define GUAC_RDP_BUFFER_POOL_CLASSES 9
+
+/**
+ * The maximum number of free buffers kept within each size class. Buffers
+ * freed beyond this are returned to the system.
+ */
+#define GUAC_RDP_BUFFER_POOL_MAX_FREE 4
+
+/**
+ * Allocates a buffer of at least the given size from the process-wide buffer
+ * pool, reusing a previously-freed buffer of the same size class if
+ * possible. This function may be called from any thread.
+ *
+ * @param size The minimum size of the buffer, in bytes.
+ * @param allocated Pointer to an int which will receive the actual size of
+ *                  the buffer allocated, which must be given when the buffer
+ *                  is freed.
+ * @return A newly-allocated buffer of at least the given size.
+ */
+void* guac_rdp_buffer_alloc(int size, int* allocated);
+
+/**
+ * Returns the given buffer to the process-wide buffer pool. If the pool
+ * already holds enough free buffers of the same size class, the buffer is
+ * freed instead. This function may be called from any thread.
+ *
+ * @param buffer The buffer to free, as returned by guac_rdp_buffer_alloc(),
+ *               or NULL.
+ * @param allocated The actual size of the buffer, as given by
+ *                  guac_rdp_buffer_alloc().
+ */
+void guac_rdp_buffer_free(void* buffer, int allocated);
+
+#endif
+
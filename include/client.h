@@ -46,7 +46,12 @@
 #include <guacamole/client.h>
 
 #include "audio.h"
+#include "event_loop.h"
+#include "flow_control.h"
+#include "input_queue.h"
+#include "output.h"
 #include "rdp_keymap.h"
+#include "rdp_pointer.h"
 
 /**
  * The default RDP port.
@@ -134,6 +139,33 @@ typedef struct rdp_guac_client_data {
      */
     guac_rdp_keysym_state_map keysym_state;
 
+    /**
+     * All pointer images uploaded during this connection, indexed by content
+     * such that identical pointers need only be sent once.
+     */
+    guac_rdp_pointer_cache_entry pointer_cache[GUAC_RDP_POINTER_CACHE_SIZE];
+
+    /**
+     * Buffer containing the embedded default pointer graphic, uploaded once
+     * when the connection is established.
+     */
+    guac_layer* default_pointer;
+
+    /**
+     * Buffer containing a single transparent pixel, used to hide the pointer
+     * when requested by the server.
+     */
+    guac_layer* null_pointer;
+
+    /**
+     * The position within the image queue following the most recent image
+     * data or cursor instruction which cursor instructions must follow.
+     * Until the image queue has been written up to this point, cursor
+     * instructions are sent through the image queue rather than the cursor
+     * queue.
+     */
+    uint32_t pointer_mark;
+
     /**
      * The current text (NOT Unicode) clipboard contents.
      */
@@ -144,11 +176,59 @@ typedef struct rdp_guac_client_data {
      */
     int audio_enabled;
 
+    /**
+     * The maximum sample rate of encoded audio, or zero if audio should be
+     * encoded at the rate provided by the server.
+     */
+    int audio_max_rate;
+
+    /**
+     * The maximum number of channels of encoded audio, or zero if audio
+     * should be encoded with the channels provided by the server.
+     */
+    int audio_max_channels;
+
+    /**
+     * The amount of audio to gather into each audio instruction, in
+     * milliseconds.
+     */
+    int audio_latency;
+
     /**
      * Audio output, if any.
      */
     audio_stream* audio;
 
+    /**
+     * Queue of all instructions awaiting transmission to the client. All
+     * instructions must be written to the socket of this queue while holding
+     * update_lock, never directly to the client's socket.
+     */
+    guac_rdp_output* output;
+
+    /**
+     * Event loop watching all RDP and channel file descriptors.
+     */
+    guac_rdp_event_loop event_loop;
+
+    /**
+     * Queue of input events received from the Guacamole client, awaiting
+     * transmission to the RDP server by the RDP thread.
+     */
+    guac_rdp_input_queue input_queue;
+
+    /**
+     * The file descriptor of the RDP connection socket, or -1 if unknown.
+     * Used only by the RDP thread when draining the input queue.
+     */
+    int rdp_fd;
+
+    /**
+     * Whether the RDP server should currently send display updates, and why
+     * not if not.
+     */
+    guac_rdp_flow_control flow;
+
     /**
      * Lock which is locked and unlocked for each update.
      */
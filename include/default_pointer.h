@@ -67,10 +67,13 @@ extern const cairo_format_t guac_rdp_default_pointer_format;
 extern unsigned char guac_rdp_default_pointer[];
 
 /**
- * Set the cursor of the remote display to the embedded cursor graphic.
+ * Draws the embedded cursor graphic to the given layer. The PNG image data
+ * for the graphic is encoded only once, and reused for all connections. The
+ * update_lock of the given client must be held.
  *
- * @param client The guac_client to send the cursor to.
+ * @param client The guac_client to send the cursor graphic to.
+ * @param layer The layer to draw the cursor graphic to.
  */
-void guac_rdp_set_default_pointer(guac_client* client);
+void guac_rdp_send_default_pointer(guac_client* client, guac_layer* layer);
 
 #endif
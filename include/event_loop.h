@@ -0,0 +1,188 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef _GUAC_RDP_EVENT_LOOP_H
+#define _GUAC_RDP_EVENT_LOOP_H
+
+#include <guacamole/protocol.h>
+
+/**
+ * The maximum number of file descriptors which may be watched by a single
+ * event loop, including those of the RDP connection and of all channels.
+ */
+#define GUAC_RDP_EVENT_LOOP_MAX_FDS 256
+
+/**
+ * The maximum amount of time to wait for events before returning control to
+ * guacd, in milliseconds. This only bounds how quickly a disconnect request
+ * from guacd is noticed; timers do not depend on it.
+ */
+#define GUAC_RDP_EVENT_LOOP_TIMEOUT 1000
+
+/**
+ * A file descriptor registered with an event loop, along with the epoll
+ * events it was registered for.
+ */
+typedef struct guac_rdp_event_loop_fd {
+
+    /**
+     * The file descriptor being watched.
+     */
+    int fd;
+
+    /**
+     * The epoll events (EPOLLIN, EPOLLOUT, etc.) being watched, or zero if
+     * the file descriptor must be registered again.
+     */
+    unsigned int events;
+
+} guac_rdp_event_loop_fd;
+
+/**
+ * epoll-based event loop. File descriptors remain registered across calls to
+ * guac_rdp_event_loop_wait(), and are only re-registered when the set of
+ * descriptors changes, or when a descriptor reports an error or hangup. A single timerfd provides wakeups at arbitrary times
+ * without relying on the wait timeout.
+ */
+typedef struct guac_rdp_event_loop {
+
+    /**
+     * The epoll instance watching all registered file descriptors.
+     */
+    int epoll_fd;
+
+    /**
+     * The timerfd used for scheduled wakeups.
+     */
+    int timer_fd;
+
+    /**
+     * The time at which the timer is currently due to expire, or zero if the
+     * timer is not armed.
+     */
+    guac_timestamp timer_deadline;
+
+    /**
+     * Non-zero if the timer expired during the last call to
+     * guac_rdp_event_loop_wait().
+     */
+    int timer_expired;
+
+    /**
+     * All file descriptors currently registered with the epoll instance,
+     * excluding the timer.
+     */
+    guac_rdp_event_loop_fd fds[GUAC_RDP_EVENT_LOOP_MAX_FDS];
+
+    /**
+     * The number of file descriptors currently registered.
+     */
+    int fd_count;
+
+} guac_rdp_event_loop;
+
+/**
+ * Initializes the given event loop, allocating its epoll instance and timer.
+ *
+ * @param loop The event loop to initialize.
+ * @return Zero on success, non-zero on error (errno will be set).
+ */
+int guac_rdp_event_loop_init(guac_rdp_event_loop* loop);
+
+/**
+ * Frees all resources associated with the given event loop. The event loop
+ * structure itself is not freed.
+ *
+ * @param loop The event loop to destroy.
+ */
+void guac_rdp_event_loop_destroy(guac_rdp_event_loop* loop);
+
+/**
+ * Permanently adds the given file descriptor to the set of file descriptors
+ * watched for reading by the given event loop. Unlike the descriptors passed
+ * to guac_rdp_event_loop_update_fds(), this descriptor remains registered
+ * until the event loop is destroyed.
+ *
+ * @param loop The event loop which should watch the file descriptor.
+ * @param fd The file descriptor to watch.
+ * @return Zero on success, non-zero on error (errno will be set).
+ */
+int guac_rdp_event_loop_watch(guac_rdp_event_loop* loop, int fd);
+
+/**
+ * Updates the set of file descriptors watched by the given event loop to
+ * match the given arrays, as returned by freerdp_get_fds() and
+ * freerdp_channels_get_fds(). Only descriptors which were added, removed, or
+ * whose events changed since the last update are registered or unregistered.
+ * A descriptor which reported an error or hangup is registered again, as it
+ * may have been closed and its number reused. If more than GUAC_RDP_EVENT_LOOP_MAX_FDS descriptors are
+ * given, this function fails with errno set to EMFILE.
+ *
+ * @param loop The event loop to update.
+ * @param read_fds The file descriptors to watch for reading.
+ * @param read_count The number of file descriptors in read_fds.
+ * @param write_fds The file descriptors to watch for writing.
+ * @param write_count The number of file descriptors in write_fds.
+ * @return Zero on success, non-zero on error (errno will be set).
+ */
+int guac_rdp_event_loop_update_fds(guac_rdp_event_loop* loop,
+        void** read_fds, int read_count, void** write_fds, int write_count);
+
+/**
+ * Waits for any registered file descriptor to become ready, for the timer to
+ * expire, or for the given timeout to elapse, whichever happens first. If the
+ * timer expired, timer_expired will be set within the event loop.
+ *
+ * @param loop The event loop to wait on.
+ * @param timeout The maximum amount of time to wait, in milliseconds.
+ * @return The number of ready file descriptors (including the timer), zero
+ *         if the timeout elapsed, or negative on error (errno will be set).
+ */
+int guac_rdp_event_loop_wait(guac_rdp_event_loop* loop, int timeout);
+
+/**
+ * Schedules a wakeup of the given event loop after the given number of
+ * milliseconds. If a wakeup is already scheduled to occur sooner, this
+ * function has no effect.
+ *
+ * @param loop The event loop to wake.
+ * @param msecs The number of milliseconds to wait before waking.
+ */
+void guac_rdp_event_loop_schedule(guac_rdp_event_loop* loop, int msecs);
+
+#endif
+
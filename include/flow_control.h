@@ -0,0 +1,359 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef _GUAC_RDP_FLOW_CONTROL_H
+#define _GUAC_RDP_FLOW_CONTROL_H
+
+#include <stdint.h>
+
+#include <guacamole/client.h>
+#include <guacamole/protocol.h>
+
+#include "output.h"
+
+/**
+ * The amount of time the client may lag behind, in milliseconds, as measured
+ * by unacknowledged sync instructions, before display updates are suppressed.
+ */
+#define GUAC_RDP_FLOW_MAX_LAG 1500
+
+/**
+ * The amount of time the client may lag behind, in milliseconds, for display
+ * updates to be resumed after having been suppressed due to lag.
+ */
+#define GUAC_RDP_FLOW_RESUME_LAG 500
+
+/**
+ * The number of bytes which may be queued for the client before display
+ * updates are suppressed.
+ */
+#define GUAC_RDP_FLOW_HIGH_WATERMARK (GUAC_RDP_OUTPUT_QUEUE_SIZE / 2)
+
+/**
+ * The number of bytes which may be queued for the client for display updates
+ * to be resumed after having been suppressed due to queued data.
+ */
+#define GUAC_RDP_FLOW_LOW_WATERMARK (GUAC_RDP_OUTPUT_QUEUE_SIZE / 8)
+
+/**
+ * The default maximum number of frames sent to the client per second.
+ */
+#define GUAC_RDP_DEFAULT_MAX_FPS 30
+
+/**
+ * The interval at which the bandwidth of the connection to the client is
+ * estimated, in milliseconds.
+ */
+#define GUAC_RDP_FLOW_ESTIMATE_INTERVAL 1000
+
+/**
+ * The number of bytes which must remain queued at the end of an estimate
+ * interval for the connection to the client to be considered saturated, in
+ * which case the measured throughput reflects the available bandwidth.
+ */
+#define GUAC_RDP_FLOW_SATURATED 0x10000
+
+/**
+ * The number of consecutive estimates which must allow a higher quality
+ * level before quality is raised.
+ */
+#define GUAC_RDP_FLOW_UPGRADE_ESTIMATES 5
+
+/**
+ * The maximum number of milliseconds which may have passed since flow
+ * control was last updated for a newly-noticed acknowledgement to be used
+ * as a round trip time sample. Acknowledgements are only noticed when the
+ * RDP thread wakes, so samples taken after a longer wait (such as the
+ * event loop timeout while the session is idle) are inflated by up to the
+ * length of that wait and are discarded.
+ */
+#define GUAC_RDP_FLOW_RTT_MAX_ERROR 20
+
+/**
+ * The default number of seconds without input or acknowledged frames after
+ * which the client is considered idle.
+ */
+#define GUAC_RDP_DEFAULT_IDLE_TIMEOUT 30
+
+/**
+ * Display updates are suppressed because the client is not keeping up with
+ * the data sent.
+ */
+#define GUAC_RDP_SUPPRESS_BACKPRESSURE 0x01
+
+/**
+ * Display updates are suppressed because the client is idle: no input has
+ * been received and no frame has been acknowledged for the idle timeout.
+ */
+#define GUAC_RDP_SUPPRESS_IDLE 0x02
+
+/**
+ * Quality level of a connection, chosen based on its estimated bandwidth and
+ * round trip time.
+ */
+typedef enum guac_rdp_quality {
+
+    /**
+     * Slow or high-latency connection. Frame rate and audio bitrate are
+     * reduced as far as reasonably possible.
+     */
+    GUAC_RDP_QUALITY_LOW,
+
+    /**
+     * Moderate connection. Frame rate and audio bitrate are somewhat
+     * reduced.
+     */
+    GUAC_RDP_QUALITY_MEDIUM,
+
+    /**
+     * Fast, low-latency connection, or one whose bandwidth has not yet been
+     * found to be limited. Configured frame rate and default audio quality
+     * are used.
+     */
+    GUAC_RDP_QUALITY_HIGH
+
+} guac_rdp_quality;
+
+/**
+ * Settings applied at a particular quality level.
+ */
+typedef struct guac_rdp_quality_settings {
+
+    /**
+     * The minimum number of milliseconds between frames at this quality
+     * level. The configured frame rate is never exceeded.
+     */
+    int frame_interval;
+
+    /**
+     * The relative quality of encoded audio at this quality level.
+     */
+    double audio_quality;
+
+} guac_rdp_quality_settings;
+
+/**
+ * State controlling the flow of display updates to the client. Updates
+ * received between frames are combined and terminated with a sync
+ * instruction no more often than the configured frame rate allows, and the
+ * round trip of each sync is measured. The RDP server is asked to stop
+ * sending display updates while any reason for suppression applies, and to
+ * resume with a full refresh of the display once none do.
+ */
+typedef struct guac_rdp_flow_control {
+
+    /**
+     * Bitwise OR of all GUAC_RDP_SUPPRESS_* reasons currently applying, or
+     * zero if display updates are allowed.
+     */
+    int suppressed;
+
+    /**
+     * The time at which display updates were last suppressed.
+     */
+    guac_timestamp suppressed_since;
+
+    /**
+     * The minimum number of milliseconds between frames, as configured, or
+     * zero if the frame rate is not limited.
+     */
+    int base_frame_interval;
+
+    /**
+     * The minimum number of milliseconds between frames at the current
+     * quality level.
+     */
+    int frame_interval;
+
+    /**
+     * The time at which the last frame was sent, as given in its sync
+     * instruction.
+     */
+    guac_timestamp last_frame;
+
+    /**
+     * Non-zero if updates have been sent to the client which have not yet
+     * been terminated with a sync instruction.
+     */
+    int frame_pending;
+
+    /**
+     * The timestamp of the most recent sync instruction acknowledged by the
+     * client.
+     */
+    guac_timestamp last_ack;
+
+    /**
+     * The time at which flow control was last updated, or zero if never
+     * updated.
+     */
+    guac_timestamp last_update;
+
+    /**
+     * The round trip time of the most recently sampled frame, in
+     * milliseconds. As acknowledgements are only noticed when the RDP thread
+     * wakes, this is an upper bound, exceeding the true value by at most
+     * GUAC_RDP_FLOW_RTT_MAX_ERROR.
+     */
+    int frame_rtt;
+
+    /**
+     * Smoothed round trip time of acknowledged frames, in milliseconds, or
+     * zero if no frame has yet been acknowledged.
+     */
+    int rtt;
+
+    /**
+     * The number of milliseconds without input or acknowledged frames after
+     * which the client is considered idle, or zero if the client is never
+     * considered idle.
+     */
+    int idle_timeout;
+
+    /**
+     * The time at which input was last received from the client. This value
+     * is updated by the input handlers.
+     */
+    volatile guac_timestamp last_input;
+
+    /**
+     * The time at which bandwidth was last estimated.
+     */
+    guac_timestamp last_estimate;
+
+    /**
+     * The total number of bytes written to the client when bandwidth was
+     * last estimated.
+     */
+    int64_t last_bytes_written;
+
+    /**
+     * Estimated bandwidth of the connection to the client, in bytes per
+     * second, or zero if the connection has not yet been found to be
+     * limited.
+     */
+    int bandwidth;
+
+    /**
+     * The current quality level.
+     */
+    guac_rdp_quality quality;
+
+    /**
+     * The number of consecutive estimates which allowed a higher quality
+     * level than the current level.
+     */
+    int upgrade_estimates;
+
+} guac_rdp_flow_control;
+
+/**
+ * Initializes the given flow control state, allowing display updates.
+ *
+ * @param flow The flow control state to initialize.
+ * @param max_fps The maximum number of frames to send per second, or zero
+ *                if the frame rate should not be limited.
+ * @param idle_timeout The number of seconds without input or acknowledged
+ *                     frames after which display updates are suppressed,
+ *                     or zero if updates should never be suppressed due to
+ *                     idleness.
+ */
+void guac_rdp_flow_init(guac_rdp_flow_control* flow, int max_fps,
+        int idle_timeout);
+
+/**
+ * Records that input has been received from the client, resuming display
+ * updates if they were suppressed due to idleness. This function may be
+ * called from any thread.
+ *
+ * @param flow The flow control state of the client.
+ */
+void guac_rdp_flow_input_received(guac_rdp_flow_control* flow);
+
+/**
+ * Returns the amount of time the client currently lags behind, in
+ * milliseconds, based on the most recent sync instructions sent and
+ * acknowledged.
+ *
+ * @param client The guac_client to estimate the lag of.
+ * @return The current lag of the client, in milliseconds.
+ */
+int guac_rdp_flow_lag(guac_client* client);
+
+/**
+ * Adds the given reason for suppressing display updates. If no other reason
+ * applied, the RDP server is asked to stop sending display updates. The
+ * caller must hold rdp_lock.
+ *
+ * @param client The guac_client whose display updates should be suppressed.
+ * @param reason The GUAC_RDP_SUPPRESS_* reason to add.
+ */
+void guac_rdp_flow_suppress(guac_client* client, int reason);
+
+/**
+ * Removes the given reason for suppressing display updates. If no other
+ * reason remains, the RDP server is asked to resume sending display updates
+ * and to refresh the entire display. The caller must hold rdp_lock.
+ *
+ * @param client The guac_client whose display updates should be resumed.
+ * @param reason The GUAC_RDP_SUPPRESS_* reason to remove.
+ */
+void guac_rdp_flow_resume(guac_client* client, int reason);
+
+/**
+ * Terminates the current frame, sending a sync instruction and flushing all
+ * updates if the frame rate allows. Otherwise, the frame remains pending,
+ * combined with any further updates, and is sent by guac_rdp_flow_update()
+ * once due. This function must be called by the RDP thread.
+ *
+ * @param client The guac_client whose current frame has ended.
+ */
+void guac_rdp_flow_end_frame(guac_client* client);
+
+/**
+ * Sends any pending frame which is due, or a sync instruction if none has
+ * been sent recently, measures the round trip of acknowledged frames, and
+ * checks how far behind the client is, suppressing or resuming display
+ * updates as necessary. This function must be called periodically by the
+ * RDP thread, and the caller must hold rdp_lock.
+ *
+ * @param client The guac_client to check.
+ */
+void guac_rdp_flow_update(guac_client* client);
+
+#endif
+
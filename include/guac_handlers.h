@@ -38,8 +38,40 @@
 #ifndef _GUAC_RDP_GUAC_HANDLERS_H
 #define _GUAC_RDP_GUAC_HANDLERS_H
 
+#include <freerdp/freerdp.h>
+
 #include <guacamole/client.h>
 
+/**
+ * The maximum number of channel events to handle during a single iteration
+ * of the event loop. Any remaining events are handled during the next
+ * iteration, which will occur without waiting.
+ */
+#define GUAC_RDP_MAX_CHANNEL_EVENTS 64
+
+/**
+ * Handler for events of a particular class received along RDP channels.
+ */
+typedef void guac_rdp_channel_event_handler(guac_client* client,
+        RDP_EVENT* event);
+
+/**
+ * Mapping of channel event class to the handler for events of that class.
+ */
+typedef struct guac_rdp_channel_event_mapping {
+
+    /**
+     * The class of event handled (RDP_EVENT_CLASS_CLIPRDR, etc.)
+     */
+    int event_class;
+
+    /**
+     * The handler to call for events of this class.
+     */
+    guac_rdp_channel_event_handler* handler;
+
+} guac_rdp_channel_event_mapping;
+
 int rdp_guac_client_free_handler(guac_client* client);
 int rdp_guac_client_handle_messages(guac_client* client);
 int rdp_guac_client_mouse_handler(guac_client* client, int x, int y, int mask);
@@ -0,0 +1,125 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef _GUAC_RDP_GUAC_PNG_H
+#define _GUAC_RDP_GUAC_PNG_H
+
+#include <cairo/cairo.h>
+
+#include <guacamole/socket.h>
+#include <guacamole/protocol.h>
+
+/**
+ * Buffer containing PNG image data which has already been encoded, and which
+ * can thus be sent any number of times without re-encoding.
+ */
+typedef struct guac_rdp_png_buffer {
+
+    /**
+     * The encoded PNG data.
+     */
+    unsigned char* data;
+
+    /**
+     * The number of bytes of PNG data currently in the buffer.
+     */
+    int length;
+
+    /**
+     * The total number of bytes allocated for the buffer.
+     */
+    int size;
+
+} guac_rdp_png_buffer;
+
+/**
+ * Encodes the given surface as PNG, storing the result within the given
+ * buffer. Any data already within the buffer is discarded.
+ *
+ * @param surface The surface to encode.
+ * @param buffer The buffer which should receive the encoded PNG data.
+ * @return Zero on success, non-zero if encoding failed.
+ */
+int guac_rdp_png_encode(cairo_surface_t* surface, guac_rdp_png_buffer* buffer);
+
+/**
+ * Frees any data allocated within the given buffer. The buffer structure
+ * itself is not freed.
+ *
+ * @param buffer The buffer whose data should be freed.
+ */
+void guac_rdp_png_buffer_free(guac_rdp_png_buffer* buffer);
+
+/**
+ * Sends a png instruction containing the given pre-encoded PNG data. This is
+ * equivalent to guac_protocol_send_png(), except that no encoding is
+ * performed.
+ *
+ * @param socket The guac_socket to write the instruction to.
+ * @param mode The composite mode to use when drawing the image.
+ * @param layer The destination layer.
+ * @param x The X coordinate of the upper-left corner of the image.
+ * @param y The Y coordinate of the upper-left corner of the image.
+ * @param buffer The buffer containing the encoded PNG data.
+ * @return Zero on success, non-zero on error.
+ */
+int guac_rdp_send_png_buffer(guac_socket* socket, guac_composite_mode mode,
+        const guac_layer* layer, int x, int y,
+        const guac_rdp_png_buffer* buffer);
+
+/**
+ * Sends the given surface as one or more png instructions, splitting large
+ * surfaces into chunks of horizontal strips. Each chunk is written as soon as
+ * it is encoded, such that the writing of earlier chunks can overlap the
+ * encoding of later chunks, and such that instructions of higher priority
+ * need not wait for the entire image. The height of each chunk is chosen
+ * such that its encoded size is roughly constant. The surface must be an
+ * image surface.
+ *
+ * @param socket The guac_socket to write the instructions to.
+ * @param mode The composite mode to use when drawing the image.
+ * @param layer The destination layer.
+ * @param x The X coordinate of the upper-left corner of the image.
+ * @param y The Y coordinate of the upper-left corner of the image.
+ * @param surface The surface to send.
+ * @return Zero on success, non-zero on error.
+ */
+int guac_rdp_send_png(guac_socket* socket, guac_composite_mode mode,
+        const guac_layer* layer, int x, int y, cairo_surface_t* surface);
+
+#endif
+
@@ -0,0 +1,302 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef _GUAC_RDP_INPUT_QUEUE_H
+#define _GUAC_RDP_INPUT_QUEUE_H
+
+#include <stdint.h>
+
+#include <freerdp/freerdp.h>
+#include <guacamole/protocol.h>
+
+/**
+ * The number of events which can be held within an input queue. This MUST be
+ * a power of two.
+ */
+#define GUAC_RDP_INPUT_QUEUE_SIZE 1024
+
+/**
+ * The maximum number of events within a single input batch. This MUST NOT
+ * exceed GUAC_RDP_INPUT_QUEUE_SIZE.
+ */
+#define GUAC_RDP_INPUT_BATCH_SIZE 32
+
+/**
+ * The default maximum number of mouse motion events sent to the RDP server
+ * per second.
+ */
+#define GUAC_RDP_DEFAULT_MOUSE_RATE 60
+
+/**
+ * The type of an RDP input event.
+ */
+typedef enum guac_rdp_input_event_type {
+
+    /**
+     * Mouse event, sent with MouseEvent().
+     */
+    GUAC_RDP_INPUT_EVENT_MOUSE,
+
+    /**
+     * Keyboard scancode event, sent with KeyboardEvent().
+     */
+    GUAC_RDP_INPUT_EVENT_KEYBOARD,
+
+    /**
+     * Unicode keyboard event, sent with UnicodeKeyboardEvent().
+     */
+    GUAC_RDP_INPUT_EVENT_UNICODE
+
+} guac_rdp_input_event_type;
+
+/**
+ * A single RDP input event, fully translated and ready to be sent.
+ */
+typedef struct guac_rdp_input_event {
+
+    /**
+     * The type of this event.
+     */
+    guac_rdp_input_event_type type;
+
+    /**
+     * The RDP flags of this event (PTR_FLAGS_*, KBD_FLAGS_*, etc.)
+     */
+    int flags;
+
+    /**
+     * The scancode or Unicode codepoint of a keyboard event.
+     */
+    int code;
+
+    /**
+     * The X coordinate of a mouse event.
+     */
+    int x;
+
+    /**
+     * The Y coordinate of a mouse event.
+     */
+    int y;
+
+} guac_rdp_input_event;
+
+/**
+ * A single slot within an input queue.
+ */
+typedef struct guac_rdp_input_queue_slot {
+
+    /**
+     * Sequence number of this slot, indicating whether the slot is free for
+     * the producer at a given position, or ready for the consumer.
+     */
+    volatile uint32_t sequence;
+
+    /**
+     * The event stored in this slot.
+     */
+    guac_rdp_input_event event;
+
+} guac_rdp_input_queue_slot;
+
+/**
+ * Bounded lock-free multiple-producer/single-consumer queue of input events.
+ * Guacamole input handlers add events to the queue without blocking on any
+ * lock, and the RDP thread sends all queued events between handling
+ * received PDUs. An eventfd wakes the RDP thread when events are added.
+ *
+ * Mouse motion is coalesced by the consumer: only the latest position is
+ * kept, and it is sent no more often than the configured rate allows. Any
+ * other event first flushes pending motion, so button, wheel and keyboard
+ * events are never dropped or reordered relative to motion.
+ */
+typedef struct guac_rdp_input_queue {
+
+    /**
+     * All slots within the queue.
+     */
+    guac_rdp_input_queue_slot slots[GUAC_RDP_INPUT_QUEUE_SIZE];
+
+    /**
+     * The position at which the next event will be added. This value is
+     * shared by all producers.
+     */
+    volatile uint32_t head;
+
+    /**
+     * The position from which the next event will be removed. This value is
+     * used only by the consumer.
+     */
+    uint32_t tail;
+
+    /**
+     * eventfd which becomes readable when events are added to the queue.
+     */
+    int event_fd;
+
+    /**
+     * The minimum number of milliseconds between mouse motion events sent to
+     * the RDP server, or zero if motion is not throttled. This value is used
+     * only by the consumer.
+     */
+    int motion_interval;
+
+    /**
+     * The most recent mouse motion event which has not yet been sent. This
+     * value is used only by the consumer.
+     */
+    guac_rdp_input_event motion;
+
+    /**
+     * Non-zero if motion contains an event which has not yet been sent.
+     */
+    int motion_pending;
+
+    /**
+     * The time at which mouse motion was last sent.
+     */
+    guac_timestamp motion_sent;
+
+} guac_rdp_input_queue;
+
+/**
+ * Events produced by a single invocation of an input handler, added to an
+ * input queue together such that they remain contiguous and are sent by the
+ * RDP thread without interruption.
+ */
+typedef struct guac_rdp_input_batch {
+
+    /**
+     * The queue this batch will be added to.
+     */
+    guac_rdp_input_queue* queue;
+
+    /**
+     * All events within this batch.
+     */
+    guac_rdp_input_event events[GUAC_RDP_INPUT_BATCH_SIZE];
+
+    /**
+     * The number of events within this batch.
+     */
+    int count;
+
+} guac_rdp_input_batch;
+
+/**
+ * Initializes the given input queue.
+ *
+ * @param queue The input queue to initialize.
+ * @param mouse_rate The maximum number of mouse motion events to send per
+ *                   second, or zero if motion should not be throttled.
+ * @return Zero on success, non-zero on error (errno will be set).
+ */
+int guac_rdp_input_queue_init(guac_rdp_input_queue* queue, int mouse_rate);
+
+/**
+ * Frees all resources associated with the given input queue. The queue
+ * structure itself is not freed.
+ *
+ * @param queue The input queue to destroy.
+ */
+void guac_rdp_input_queue_destroy(guac_rdp_input_queue* queue);
+
+/**
+ * Adds the given events to the given input queue as a contiguous block,
+ * waking the consumer. If the queue is full, this function yields until
+ * space is available. This function may be called by any number of threads
+ * simultaneously.
+ *
+ * @param queue The input queue to add events to.
+ * @param events The events to add.
+ * @param count The number of events to add.
+ */
+void guac_rdp_input_queue_push(guac_rdp_input_queue* queue,
+        const guac_rdp_input_event* events, int count);
+
+/**
+ * Initializes the given input batch, which will be added to the given queue
+ * when flushed.
+ *
+ * @param batch The input batch to initialize.
+ * @param queue The input queue the batch will be added to.
+ */
+void guac_rdp_input_batch_init(guac_rdp_input_batch* batch,
+        guac_rdp_input_queue* queue);
+
+/**
+ * Adds a single event to the given input batch. If the batch is full, the
+ * events already within the batch are added to its queue first.
+ *
+ * @param batch The input batch to add the event to.
+ * @param type The type of the event.
+ * @param flags The RDP flags of the event.
+ * @param code The scancode or Unicode codepoint of a keyboard event.
+ * @param x The X coordinate of a mouse event.
+ * @param y The Y coordinate of a mouse event.
+ */
+void guac_rdp_input_batch_add(guac_rdp_input_batch* batch,
+        guac_rdp_input_event_type type, int flags, int code, int x, int y);
+
+/**
+ * Adds all events within the given input batch to its queue, leaving the
+ * batch empty.
+ *
+ * @param batch The input batch to flush.
+ */
+void guac_rdp_input_batch_flush(guac_rdp_input_batch* batch);
+
+/**
+ * Sends all events within the given input queue using the given FreeRDP
+ * instance, coalescing mouse motion. This function may only be called by the
+ * single consumer of the queue, and the caller must hold rdp_lock. While
+ * events are being sent, the given RDP socket is corked, such that the PDUs
+ * of all events are transmitted together.
+ *
+ * @param queue The input queue to drain.
+ * @param rdp_inst The FreeRDP instance to send events with.
+ * @param rdp_fd The file descriptor of the RDP connection socket, or -1 if
+ *               unknown.
+ * @return The number of milliseconds until coalesced mouse motion may be
+ *         sent, in which case the queue must be drained again after that
+ *         time, or -1 if no motion remains pending.
+ */
+int guac_rdp_input_queue_drain(guac_rdp_input_queue* queue,
+        freerdp* rdp_inst, int rdp_fd);
+
+#endif
+
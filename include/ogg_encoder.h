@@ -42,6 +42,13 @@
 
 #include <vorbis/vorbisenc.h>
 
+/**
+ * Function which converts the given number of interleaved PCM frames into
+ * the separate per-channel float buffers expected by Vorbis.
+ */
+typedef void ogg_encoder_convert_handler(float** buffer,
+        const unsigned char* pcm_data, int frames, int channels);
+
 typedef struct ogg_encoder_state {
 
     /**
@@ -59,6 +66,29 @@ typedef struct ogg_encoder_state {
     vorbis_dsp_state vorbis_state;
     vorbis_block vorbis_block;
 
+    /**
+     * The sample rate, number of channels, and quality the encoder was
+     * initialized with. The encoder settings are reused for all audio chunks
+     * having the same values.
+     */
+    int rate;
+    int channels;
+    int bps;
+    double quality;
+
+    /**
+     * Converter for PCM data in the format above, chosen once when the
+     * encoder is initialized.
+     */
+    ogg_encoder_convert_handler* convert;
+
+    /**
+     * Non-zero if a logical stream has been started for the current audio
+     * chunk and not yet ended. Each chunk is sent as a standalone Ogg file,
+     * and thus has its own Vorbis analysis state and Ogg stream.
+     */
+    int stream_open;
+
 } ogg_encoder_state;
 
 extern audio_encoder* ogg_encoder;
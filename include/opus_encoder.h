@@ -0,0 +1,184 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef __GUAC_OPUS_ENCODER_H
+#define __GUAC_OPUS_ENCODER_H
+
+#include "audio.h"
+#include "audio_resampler.h"
+
+#include <ogg/ogg.h>
+#include <opus/opus.h>
+
+/**
+ * The duration of each Opus frame, in milliseconds.
+ */
+#define OPUS_ENCODER_FRAME_DURATION 20
+
+/**
+ * The maximum size of a single encoded Opus packet, in bytes.
+ */
+#define OPUS_ENCODER_MAX_PACKET 4000
+
+/**
+ * The bitrate used when encoding at the lowest quality (0.0), in bits per
+ * second.
+ */
+#define OPUS_ENCODER_MIN_BITRATE 16000
+
+/**
+ * The bitrate used when encoding at the highest quality (1.0), in bits per
+ * second.
+ */
+#define OPUS_ENCODER_MAX_BITRATE 128000
+
+/**
+ * The vendor string stored within the Opus comment header.
+ */
+#define OPUS_ENCODER_VENDOR "libguac-client-rdp"
+
+/**
+ * The length of the vendor string, excluding null terminator.
+ */
+#define OPUS_ENCODER_VENDOR_LENGTH (sizeof(OPUS_ENCODER_VENDOR) - 1)
+
+/**
+ * The length of the Opus identification header, in bytes.
+ */
+#define OPUS_ENCODER_HEAD_LENGTH 19
+
+/**
+ * The length of the Opus comment header, in bytes, which contains only the
+ * vendor string.
+ */
+#define OPUS_ENCODER_TAGS_LENGTH (8 + 4 + OPUS_ENCODER_VENDOR_LENGTH + 4)
+
+typedef struct opus_encoder_state {
+
+    /**
+     * Ogg state
+     */
+    ogg_stream_state ogg_state;
+    ogg_page ogg_page;
+
+    /**
+     * Opus encoder, configured for low delay.
+     */
+    OpusEncoder* encoder;
+
+    /**
+     * The sample rate, number of channels, and bits per sample of PCM data
+     * the encoder was initialized for. The encoder is reused for all audio
+     * chunks having the same values.
+     */
+    int rate;
+    int channels;
+    int bps;
+
+    /**
+     * The quality the encoder bitrate was last set from.
+     */
+    double quality;
+
+    /**
+     * The sample rate and number of channels actually encoded. Opus supports
+     * only a few sample rates and at most two channels.
+     */
+    int encoder_rate;
+    int encoder_channels;
+
+    /**
+     * Resampler converting PCM data to the format above, or NULL if PCM data
+     * can be encoded as-is.
+     */
+    audio_resampler* resampler;
+
+    /**
+     * The PCM samples of the frame currently being filled.
+     */
+    opus_int16* frame;
+
+    /**
+     * The number of samples per channel within each frame.
+     */
+    int frame_size;
+
+    /**
+     * The number of samples per channel currently within the frame.
+     */
+    int frame_used;
+
+    /**
+     * The number of samples per channel of encoder delay, which the decoder
+     * must skip at the start of each chunk.
+     */
+    int pre_skip;
+
+    /**
+     * The number of samples per channel of PCM data received for the
+     * current audio chunk.
+     */
+    int samples;
+
+    /**
+     * The number of samples per channel encoded for the current audio
+     * chunk, including any padding.
+     */
+    int encoded;
+
+    /**
+     * The sequence number of the next packet within the current audio
+     * chunk.
+     */
+    ogg_int64_t packetno;
+
+    /**
+     * The Opus identification header, sent at the start of every chunk.
+     */
+    unsigned char head[OPUS_ENCODER_HEAD_LENGTH];
+
+    /**
+     * The Opus comment header, sent at the start of every chunk.
+     */
+    unsigned char tags[OPUS_ENCODER_TAGS_LENGTH];
+
+} opus_encoder_state;
+
+extern audio_encoder* opus_encoder;
+
+#endif
+
@@ -0,0 +1,400 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef _GUAC_RDP_OUTPUT_H
+#define _GUAC_RDP_OUTPUT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <guacamole/client.h>
+#include <guacamole/socket.h>
+
+/**
+ * The size of the image queue, in bytes. This MUST be a power of two.
+ */
+#define GUAC_RDP_OUTPUT_QUEUE_SIZE 0x100000
+
+/**
+ * The size of the cursor and audio queues, in bytes. This MUST be a power of
+ * two.
+ */
+#define GUAC_RDP_OUTPUT_PRIORITY_QUEUE_SIZE 0x40000
+
+/**
+ * The number of instruction boundaries which can be recorded within the
+ * image queue. This MUST be a power of two.
+ */
+#define GUAC_RDP_OUTPUT_BOUNDARIES 0x4000
+
+/**
+ * The number of instruction boundaries which can be recorded within the
+ * cursor and audio queues. This MUST be a power of two.
+ */
+#define GUAC_RDP_OUTPUT_PRIORITY_BOUNDARIES 0x400
+
+/**
+ * The maximum number of bytes of complete instructions written to the
+ * client's socket at once before higher-priority queues are checked again.
+ * A single instruction larger than this is still written whole.
+ */
+#define GUAC_RDP_OUTPUT_MAX_WRITE 0x10000
+
+/**
+ * The interval at which sync instructions are sent through the output queue,
+ * in milliseconds, such that the timestamps echoed by the client stay
+ * current even while no frames are sent.
+ */
+#define GUAC_RDP_OUTPUT_SYNC_INTERVAL 1000
+
+/**
+ * The lag, in milliseconds, at which guacd stops calling handle_messages
+ * until the client acknowledges the last sync sent.
+ */
+#ifdef GUAC_SYNC_THRESHOLD
+#define GUAC_RDP_OUTPUT_SYNC_THRESHOLD GUAC_SYNC_THRESHOLD
+#else
+#define GUAC_RDP_OUTPUT_SYNC_THRESHOLD 500
+#endif
+
+/**
+ * The priority of an output queue. Queues of higher priority (lower value)
+ * are always written first, switching between queues only at instruction
+ * boundaries.
+ */
+typedef enum guac_rdp_output_priority {
+
+    /**
+     * Audio instructions.
+     */
+    GUAC_RDP_OUTPUT_AUDIO,
+
+    /**
+     * Cursor instructions.
+     */
+    GUAC_RDP_OUTPUT_CURSOR,
+
+    /**
+     * All other instructions, including images and sync instructions. Sync
+     * instructions must follow the images of their frame, and thus share
+     * this queue.
+     */
+    GUAC_RDP_OUTPUT_IMAGE,
+
+    /**
+     * The number of output queues.
+     */
+    GUAC_RDP_OUTPUT_PRIORITIES
+
+} guac_rdp_output_priority;
+
+typedef struct guac_rdp_output guac_rdp_output;
+
+/**
+ * A single queue of Guacamole instruction data, written through its own
+ * guac_socket. Each queue is a lock-free single-producer/single-consumer
+ * ring: the producer of the audio queue is the audio encoder thread, the
+ * producer of all other queues is whichever thread holds update_lock, and the
+ * consumer is the writer thread. The end of each complete instruction is
+ * recorded in a second ring, such that the writer thread can switch between
+ * queues without splitting instructions.
+ */
+typedef struct guac_rdp_output_queue {
+
+    /**
+     * The output this queue belongs to.
+     */
+    guac_rdp_output* output;
+
+    /**
+     * Socket which queues all data written to it within this queue.
+     */
+    guac_socket* socket;
+
+    /**
+     * Ring buffer of queued data.
+     */
+    unsigned char* buffer;
+
+    /**
+     * The size of the ring buffer, in bytes.
+     */
+    uint32_t size;
+
+    /**
+     * The total number of bytes ever written to the queue. This value is
+     * updated only by the producer.
+     */
+    volatile uint32_t head;
+
+    /**
+     * The total number of bytes ever read from the queue. This value is
+     * updated only by the consumer.
+     */
+    volatile uint32_t tail;
+
+    /**
+     * Ring of queue positions immediately following the end of each complete
+     * instruction not yet read.
+     */
+    uint32_t* boundaries;
+
+    /**
+     * The number of entries within the boundary ring.
+     */
+    uint32_t boundaries_size;
+
+    /**
+     * The total number of boundaries ever recorded. This value is updated
+     * only by the producer.
+     */
+    volatile uint32_t boundaries_head;
+
+    /**
+     * The total number of boundaries ever passed by the consumer. This value
+     * is updated only by the consumer.
+     */
+    volatile uint32_t boundaries_tail;
+
+    /**
+     * Non-zero if the element currently being written is within its value,
+     * rather than its length prefix. Used only by the producer to locate the
+     * end of each instruction.
+     */
+    int parse_in_value;
+
+    /**
+     * The length prefix of the element currently being written, or the
+     * number of characters of its value which remain. Used only by the
+     * producer.
+     */
+    int parse_remaining;
+
+    /**
+     * Non-zero if this queue shares its producer with the other queues for
+     * which this is also non-zero.
+     */
+    int shared;
+
+    /**
+     * Non-zero if the producer is waiting on this queue for free space.
+     */
+    volatile int blocked;
+
+    /**
+     * Non-zero if the producer is sleeping until this queue has free space.
+     */
+    volatile int producer_waiting;
+
+} guac_rdp_output_queue;
+
+/**
+ * Prioritized queues of Guacamole instruction data awaiting transmission to
+ * the client, along with the dedicated thread which writes that data to the
+ * client's socket. guacd writes its own instructions directly to the client's
+ * socket outside of handle_messages, so the writer thread is paused at an
+ * instruction boundary whenever control returns to guacd. Instructions are written to the queues through the
+ * guac_socket of each queue. The mutex and condition are used only to sleep
+ * while there is nothing to write, or while a queue is full.
+ */
+struct guac_rdp_output {
+
+    /**
+     * The client whose socket will receive all queued data.
+     */
+    guac_client* client;
+
+    /**
+     * All queues, in order of priority.
+     */
+    guac_rdp_output_queue queues[GUAC_RDP_OUTPUT_PRIORITIES];
+
+    /**
+     * Socket which queues all data written to it within the image queue. All
+     * instructions sent during the connection should be written to this
+     * socket, the cursor socket, or the audio socket, rather than directly to
+     * the client's socket.
+     */
+    guac_socket* socket;
+
+    /**
+     * Socket which queues all data written to it within the cursor queue.
+     */
+    guac_socket* cursor_socket;
+
+    /**
+     * Socket which queues all data written to it within the audio queue. Only
+     * the audio encoder thread may write to this socket, and it must flush
+     * this socket after each instruction.
+     */
+    guac_socket* audio_socket;
+
+    /**
+     * The index of the queue containing a partially-written instruction, or
+     * -1 if the writer thread is at an instruction boundary in all queues.
+     * Used only by the consumer.
+     */
+    int current;
+
+    /**
+     * Non-zero if the writer thread is waiting for data.
+     */
+    volatile int consumer_waiting;
+
+    /**
+     * Non-zero if the writer thread should stop writing at the next
+     * instruction boundary, once all data before the pause marks is written.
+     */
+    volatile int paused;
+
+    /**
+     * Non-zero if the writer thread has stopped writing due to a pause.
+     */
+    volatile int parked;
+
+    /**
+     * The position within each queue which must be written before the
+     * writer thread may stop writing due to a pause.
+     */
+    uint32_t pause_marks[GUAC_RDP_OUTPUT_PRIORITIES];
+
+    /**
+     * Non-zero if the writer thread should stop once all queues are empty.
+     */
+    volatile int stopping;
+
+    /**
+     * Non-zero if writing to the client's socket has failed. Once set, all
+     * further queued data is discarded.
+     */
+    volatile int failed;
+
+    /**
+     * The total number of bytes written to the client's socket.
+     */
+    volatile int64_t bytes_written;
+
+    /**
+     * Lock used only to sleep on the condition below.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Condition signalled when data or free space becomes available, or when
+     * the writer thread is paused or resumed.
+     */
+    pthread_cond_t cond;
+
+    /**
+     * The writer thread.
+     */
+    pthread_t thread;
+
+};
+
+/**
+ * Allocates a new output queue for the given client and starts its writer
+ * thread.
+ *
+ * @param client The client whose socket should receive all queued data.
+ * @return The newly-allocated output queue, or NULL on error.
+ */
+guac_rdp_output* guac_rdp_output_alloc(guac_client* client);
+
+/**
+ * Flushes all queued data, stops the writer thread, and frees the given
+ * output queue. The client's socket is flushed before this function returns.
+ *
+ * @param output The output queue to free.
+ */
+void guac_rdp_output_free(guac_rdp_output* output);
+
+/**
+ * Pauses the writer thread once it reaches an instruction boundary, waiting
+ * until it has stopped writing to the client's socket. This must be called
+ * before control returns to guacd, as guacd writes directly to the client's
+ * socket. Any data buffered within the sockets of the image and cursor queues
+ * must be flushed first, as the writer thread may be waiting on the remainder
+ * of an instruction within that data.
+ *
+ * @param output The output queue to pause.
+ * @param drain Non-zero if all data currently queued must be written to the
+ *              client before the writer thread stops, zero if the writer
+ *              thread need only finish its current instruction.
+ */
+void guac_rdp_output_pause(guac_rdp_output* output, int drain);
+
+/**
+ * Resumes a writer thread paused with guac_rdp_output_pause().
+ *
+ * @param output The output queue to resume.
+ */
+void guac_rdp_output_resume(guac_rdp_output* output);
+
+/**
+ * Returns the number of bytes currently queued within all queues and not
+ * yet written to the client's socket.
+ *
+ * @param output The output queue to inspect.
+ * @return The number of bytes currently queued.
+ */
+int guac_rdp_output_queued(guac_rdp_output* output);
+
+/**
+ * Flushes the image socket of the given output, returning the position of
+ * the end of all data written to the image queue thus far. The caller must
+ * hold update_lock.
+ *
+ * @param output The output to mark.
+ * @return The current position of the end of the image queue.
+ */
+uint32_t guac_rdp_output_mark(guac_rdp_output* output);
+
+/**
+ * Returns whether all data written to the image queue prior to the given
+ * mark has been written to the client's socket. Instructions written to a
+ * higher-priority queue may depend on earlier image data only once that
+ * data has been sent.
+ *
+ * @param output The output to inspect.
+ * @param mark A position returned by guac_rdp_output_mark().
+ * @return Non-zero if all image data prior to the mark has been sent, zero
+ *         otherwise.
+ */
+int guac_rdp_output_sent(guac_rdp_output* output, uint32_t mark);
+
+#endif
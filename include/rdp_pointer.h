@@ -39,10 +39,61 @@
 #ifndef _GUAC_RDP_RDP_POINTER_H
 #define _GUAC_RDP_RDP_POINTER_H
 
+#include <stdint.h>
+
 #include <freerdp/freerdp.h>
 
+#include <guacamole/client.h>
 #include <guacamole/protocol.h>
 
+/**
+ * The maximum number of distinct pointer images which will be cached within
+ * a single connection.
+ */
+#define GUAC_RDP_POINTER_CACHE_SIZE 32
+
+/**
+ * A single pointer image which has been uploaded to a buffer, along with the
+ * information necessary to recognize identical images received later.
+ */
+typedef struct guac_rdp_pointer_cache_entry {
+
+    /**
+     * Hash of the converted ARGB image data of this pointer.
+     */
+    uint64_t hash;
+
+    /**
+     * The converted ARGB image data of this pointer, compared against new
+     * pointers having the same hash such that a hash collision cannot
+     * result in the wrong image being used.
+     */
+    unsigned char* data;
+
+    /**
+     * The width of the pointer image, in pixels.
+     */
+    int width;
+
+    /**
+     * The height of the pointer image, in pixels.
+     */
+    int height;
+
+    /**
+     * The buffer containing the uploaded pointer image, or NULL if this
+     * entry is unused.
+     */
+    guac_layer* layer;
+
+    /**
+     * The number of rdpPointers currently referencing this entry. When this
+     * reaches zero, the buffer is freed and the entry becomes unused.
+     */
+    int refcount;
+
+} guac_rdp_pointer_cache_entry;
+
 typedef struct guac_rdp_pointer {
 
     /**
@@ -57,6 +108,22 @@ typedef struct guac_rdp_pointer {
 
 } guac_rdp_pointer;
 
+/**
+ * Clears the given pointer cache, marking all entries as unused. No buffers
+ * are freed.
+ *
+ * @param cache The pointer cache to clear.
+ */
+void guac_rdp_pointer_cache_init(guac_rdp_pointer_cache_entry* cache);
+
+/**
+ * Frees the image data of all entries still within the given pointer cache,
+ * marking all entries as unused. No buffers are freed.
+ *
+ * @param cache The pointer cache to free.
+ */
+void guac_rdp_pointer_cache_free(guac_rdp_pointer_cache_entry* cache);
+
 void guac_rdp_pointer_new(rdpContext* context, rdpPointer* pointer);
 void guac_rdp_pointer_set(rdpContext* context, rdpPointer* pointer);
 void guac_rdp_pointer_free(rdpContext* context, rdpPointer* pointer);
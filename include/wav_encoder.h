@@ -106,21 +106,15 @@ typedef struct wav_encoder_fmt_header {
 typedef struct wav_encoder_state {
 
     /**
-     * Arbitrary PCM data available for writing when the overall WAV is
-     * flushed.
-     */
-    unsigned char* data_buffer;
-
-    /**
-     * The number of bytes currently present in the data buffer.
+     * The number of bytes of PCM data written since the chunk began.
      */
     int used;
 
     /**
-     * The total number of bytes that can be written into the data buffer
-     * without requiring resizing.
+     * The offset within the encoded data buffer of the space reserved for
+     * the WAV headers.
      */
-    int length;
+    int header_offset;
 
 } wav_encoder_state;
 
@@ -138,6 +132,12 @@ typedef struct wav_encoder_data_header {
 
 } wav_encoder_data_header;
 
+/**
+ * The total size of all WAV headers preceding the PCM data, in bytes.
+ */
+#define WAV_HEADER_SIZE (sizeof(wav_encoder_riff_header) \
+        + sizeof(wav_encoder_fmt_header) + sizeof(wav_encoder_data_header))
+
 extern audio_encoder* wav_encoder;
 
 #endif
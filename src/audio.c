@@ -35,46 +35,266 @@
  *
  * ***** END LICENSE BLOCK ***** */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 #include <guacamole/protocol.h>
 #include <guacamole/client.h>
 #include <guacamole/stream.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "audio.h"
+#include "audio_resampler.h"
+#include "buffer_pool.h"
 #include "client.h"
 
+/**
+ * Returns the duration of the PCM data written to the given audio stream
+ * since the current audio chunk began, in milliseconds.
+ */
+double __audio_stream_duration(audio_stream* audio) {
+    return ((double) (audio->pcm_bytes_written * 1000 * 8))
+                / audio->rate / audio->channels / audio->bps;
+}
+
+/**
+ * Returns the amount of audio, in milliseconds, which should be gathered
+ * into each audio instruction given the current activity of the user.
+ */
+int __audio_stream_latency_target(audio_stream* audio) {
+
+    rdp_guac_client_data* data = (rdp_guac_client_data*) audio->client->data;
+
+    guac_timestamp since_input =
+        guac_protocol_get_timestamp() - data->flow.last_input;
+
+    /* Favor latency over overhead while the user is interacting */
+    if (since_input < GUAC_AUDIO_INTERACTIVE_TIMEOUT
+            && audio->latency > GUAC_AUDIO_INTERACTIVE_LATENCY)
+        return GUAC_AUDIO_INTERACTIVE_LATENCY;
+
+    return audio->latency;
+
+}
+
+/**
+ * Returns the buffers of all chunks not in use to the buffer pool. The queue
+ * lock must be held, and the queue must be empty.
+ */
+void __audio_stream_release_chunks(audio_stream* audio) {
+
+    int i;
+
+    for (i=0; i<GUAC_AUDIO_QUEUE_SIZE; i++) {
+
+        audio_chunk* chunk = &(audio->queue[i]);
+
+        /* The producer may be filling the chunk at the head */
+        if (audio->queue_filling && i == audio->queue_head)
+            continue;
+
+        guac_rdp_buffer_free(chunk->data, chunk->size);
+        chunk->data = NULL;
+        chunk->size = 0;
+
+    }
+
+}
+
+/**
+ * Encodes each PCM chunk queued on the given audio stream, until the stream
+ * is stopped. Consecutive chunks of the same format are gathered into a
+ * single audio instruction, which is sent once it holds enough audio to meet
+ * the latency target, or once the latency target has passed since its first
+ * chunk was received.
+ */
+void* __audio_stream_encoder_thread(void* arg) {
+
+    audio_stream* audio = (audio_stream*) arg;
+
+    /* Input format of the open audio instruction, if any */
+    int open = 0;
+    int rate = 0;
+    int channels = 0;
+    int bps = 0;
+    guac_timestamp opened = 0;
+
+    pthread_mutex_lock(&(audio->queue_lock));
+
+    for (;;) {
+
+        audio_chunk* chunk;
+
+        /* Wait for a chunk, sending any open instruction once due */
+        while (audio->queue_length == 0 && !audio->stopping) {
+
+            if (open) {
+
+                struct timespec deadline;
+                guac_timestamp due = opened
+                    + __audio_stream_latency_target(audio);
+
+                deadline.tv_sec  =  due / 1000;
+                deadline.tv_nsec = (due % 1000) * 1000000;
+
+                if (pthread_cond_timedwait(&(audio->queue_changed),
+                            &(audio->queue_lock), &deadline) == ETIMEDOUT) {
+                    pthread_mutex_unlock(&(audio->queue_lock));
+                    audio_stream_end(audio);
+                    open = 0;
+                    pthread_mutex_lock(&(audio->queue_lock));
+                }
+
+            }
+
+            /* Release buffers while idle */
+            else {
+                guac_rdp_buffer_free(audio->encoded_data,
+                        audio->encoded_data_length);
+                audio->encoded_data = NULL;
+                audio->encoded_data_length = 0;
+                __audio_stream_release_chunks(audio);
+                pthread_cond_wait(&(audio->queue_changed),
+                        &(audio->queue_lock));
+            }
+
+        }
+
+        if (audio->stopping)
+            break;
+
+        /*
+         * The head chunk is not reused by the producer until it is removed
+         * from the queue, so it can be encoded without holding the lock.
+         */
+        chunk = &(audio->queue[audio->queue_head]);
+        pthread_mutex_unlock(&(audio->queue_lock));
+
+        /* Chunks of differing format cannot share an instruction */
+        if (open && (chunk->rate != rate || chunk->channels != channels
+                    || chunk->bps != bps)) {
+            audio_stream_end(audio);
+            open = 0;
+        }
+
+        if (!open) {
+            rate = chunk->rate;
+            channels = chunk->channels;
+            bps = chunk->bps;
+            opened = guac_protocol_get_timestamp();
+            audio_stream_begin(audio, rate, channels, bps);
+            open = 1;
+        }
+
+        /* The chunk keeps its buffer for reuse by the producer */
+        audio_stream_write_pcm(audio, chunk->data, chunk->length);
+
+        /* Send once enough audio has been gathered */
+        if (__audio_stream_duration(audio)
+                >= __audio_stream_latency_target(audio)) {
+            audio_stream_end(audio);
+            open = 0;
+        }
+
+        /* Remove chunk from queue */
+        pthread_mutex_lock(&(audio->queue_lock));
+        audio->queue_head = (audio->queue_head + 1) % GUAC_AUDIO_QUEUE_SIZE;
+        audio->queue_length--;
+
+    }
+
+    pthread_mutex_unlock(&(audio->queue_lock));
+    return NULL;
+
+}
+
 audio_stream* audio_stream_alloc(guac_client* client, audio_encoder* encoder) {
 
     /* Allocate stream */
     audio_stream* audio = (audio_stream*) malloc(sizeof(audio_stream));
     audio->client = client;
 
-    /* Reset buffer stats */
-    audio->used = 0;
-    audio->length = 0x40000;
-
+    /* Buffer is allocated from the buffer pool only when needed */
     audio->encoded_data_used = 0;
-    audio->encoded_data_length = 0x40000;
-
-    /* Allocate buffers */
-    audio->pcm_data = malloc(audio->length);
-    audio->encoded_data = malloc(audio->encoded_data_length);
+    audio->encoded_data_length = 0;
+    audio->encoded_data = NULL;
 
     /* Assign encoder */
     audio->encoder = encoder;
+    audio->quality = GUAC_AUDIO_DEFAULT_QUALITY;
+    audio->latency = GUAC_AUDIO_DEFAULT_LATENCY;
+    audio->data = NULL;
+
+    /* No conversion unless configured */
+    audio->max_rate = 0;
+    audio->max_channels = 0;
+    audio->resampler = NULL;
+    audio->resampling = 0;
     audio->stream = guac_client_alloc_stream(client);
 
+    /* Start encoder thread with an empty queue */
+    memset(audio->queue, 0, sizeof(audio->queue));
+    audio->queue_head = 0;
+    audio->queue_length = 0;
+    audio->queue_filling = 0;
+    audio->stopping = 0;
+    pthread_mutex_init(&(audio->queue_lock), NULL);
+    pthread_cond_init(&(audio->queue_changed), NULL);
+    pthread_create(&(audio->encoder_thread), NULL,
+            __audio_stream_encoder_thread, audio);
+
     return audio;
 }
 
+int audio_stream_format_native(audio_stream* audio, int rate, int channels) {
+    return (audio->max_rate == 0 || rate <= audio->max_rate)
+        && (audio->max_channels == 0 || channels <= audio->max_channels);
+}
+
 void audio_stream_begin(audio_stream* audio, int rate, int channels, int bps) {
 
-    /* Load PCM properties */
-    audio->rate = rate;
-    audio->channels = channels;
-    audio->bps = bps;
+    /* Convert if format exceeds limits */
+    if (!audio_stream_format_native(audio, rate, channels)) {
+
+        int out_rate = rate;
+        int out_channels = channels;
+
+        if (audio->max_rate != 0 && out_rate > audio->max_rate)
+            out_rate = audio->max_rate;
+
+        if (audio->max_channels != 0 && out_channels > audio->max_channels)
+            out_channels = audio->max_channels;
+
+        /* Resampler output is limited in channels */
+        if (out_channels > AUDIO_RESAMPLER_MAX_CHANNELS)
+            out_channels = AUDIO_RESAMPLER_MAX_CHANNELS;
+
+        if (audio->resampler == NULL)
+            audio->resampler = audio_resampler_alloc();
+
+        audio_resampler_set_format(audio->resampler, rate, channels, bps,
+                out_rate, out_channels);
+
+        /* Encoder receives converted data */
+        audio->rate = out_rate;
+        audio->channels = out_channels;
+        audio->bps = 16;
+        audio->resampling = 1;
+
+    }
+
+    /* Otherwise, load PCM properties as-is */
+    else {
+        audio->rate = rate;
+        audio->channels = channels;
+        audio->bps = bps;
+        audio->resampling = 0;
+    }
 
     /* Reset write counter */
     audio->pcm_bytes_written = 0;
@@ -90,22 +310,18 @@ void audio_stream_end(audio_stream* audio) {
 
     rdp_guac_client_data* data = (rdp_guac_client_data*) audio->client->data;
 
-    /* Flush stream and finish encoding */
-    audio_stream_flush(audio);
+    /* Finish encoding */
     audio->encoder->end_handler(audio);
 
     /* Calculate duration of PCM data */
-    duration = ((double) (audio->pcm_bytes_written * 1000 * 8))
-                / audio->rate / audio->channels / audio->bps;
+    duration = __audio_stream_duration(audio);
 
-    pthread_mutex_lock(&(data->update_lock));
-
-    /* Send audio */
-    guac_protocol_send_audio(audio->stream->socket,
+    /* Send audio ahead of any queued images. The encoder thread is the only
+     * writer of the audio socket, so update_lock is not needed. */
+    guac_protocol_send_audio(data->output->audio_socket,
             0, audio->encoder->mimetype,
             duration, audio->encoded_data, audio->encoded_data_used);
-
-    pthread_mutex_unlock(&(data->update_lock));
+    guac_socket_flush(data->output->audio_socket);
 
     /* Clear data */
     audio->encoded_data_used = 0;
@@ -113,67 +329,240 @@ void audio_stream_end(audio_stream* audio) {
 }
 
 void audio_stream_free(audio_stream* audio) {
-    free(audio->pcm_data);
+
+    int i;
+
+    /* Stop encoder thread */
+    pthread_mutex_lock(&(audio->queue_lock));
+    audio->stopping = 1;
+    pthread_cond_signal(&(audio->queue_changed));
+    pthread_mutex_unlock(&(audio->queue_lock));
+    pthread_join(audio->encoder_thread, NULL);
+
+    pthread_cond_destroy(&(audio->queue_changed));
+    pthread_mutex_destroy(&(audio->queue_lock));
+
+    for (i=0; i<GUAC_AUDIO_QUEUE_SIZE; i++)
+        guac_rdp_buffer_free(audio->queue[i].data, audio->queue[i].size);
+
+    /* Free any encoder state kept across chunks */
+    if (audio->encoder->free_handler != NULL)
+        audio->encoder->free_handler(audio);
+
+    if (audio->resampler != NULL)
+        audio_resampler_free(audio->resampler);
+
+    guac_rdp_buffer_free(audio->encoded_data, audio->encoded_data_length);
     free(audio);
+
 }
 
 void audio_stream_write_pcm(audio_stream* audio, 
         unsigned char* data, int length) {
 
+    /* Convert data first if necessary, dropping it if conversion fails */
+    if (audio->resampling) {
+        length = audio_resampler_convert(audio->resampler, data, length,
+                &data);
+        if (length < 0)
+            return;
+    }
+
     /* Update counter */
     audio->pcm_bytes_written += length;
 
-    /* Resize audio buffer if necessary */
-    if (length > audio->length) {
+    /* Encode data in place */
+    audio->encoder->write_handler(audio, data, length);
+
+}
+
+unsigned char* audio_stream_reserve_pcm(audio_stream* audio, int length) {
+
+    audio_chunk* chunk;
 
-        /* Resize to double provided length */
-        audio->length = length*2;
-        audio->pcm_data = realloc(audio->pcm_data, audio->length);
+    pthread_mutex_lock(&(audio->queue_lock));
 
+    /* Drop data if encoder is too far behind */
+    if (audio->queue_length == GUAC_AUDIO_QUEUE_SIZE) {
+        pthread_mutex_unlock(&(audio->queue_lock));
+        return NULL;
     }
 
-    /* Flush if necessary */
-    if (audio->used + length > audio->length)
-        audio_stream_flush(audio);
+    chunk = &(audio->queue[(audio->queue_head + audio->queue_length)
+        % GUAC_AUDIO_QUEUE_SIZE]);
 
-    /* Append to buffer */
-    memcpy(&(audio->pcm_data[audio->used]), data, length);
-    audio->used += length;
+    audio->queue_filling = 1;
+    pthread_mutex_unlock(&(audio->queue_lock));
+
+    /* Chunk is not yet visible to the encoder thread, so fill it unlocked,
+     * reusing its buffer from previous use if large enough */
+    if (chunk->size < length) {
+
+        guac_rdp_buffer_free(chunk->data, chunk->size);
+        chunk->data = guac_rdp_buffer_alloc(length, &(chunk->size));
+
+        if (chunk->data == NULL) {
+            chunk->size = 0;
+            audio_stream_queue_reserved(audio, 0, 0, 0, 0);
+            return NULL;
+        }
+
+    }
+
+    return chunk->data;
 
 }
 
-void audio_stream_flush(audio_stream* audio) {
+void audio_stream_queue_reserved(audio_stream* audio, int rate, int channels,
+        int bps, int length) {
+
+    audio_chunk* chunk;
 
-    /* If data in buffer */
-    if (audio->used != 0) {
+    pthread_mutex_lock(&(audio->queue_lock));
 
-        /* Write data */
-        audio->encoder->write_handler(audio,
-                audio->pcm_data, audio->used);
+    chunk = &(audio->queue[(audio->queue_head + audio->queue_length)
+        % GUAC_AUDIO_QUEUE_SIZE]);
 
-        /* Reset buffer */
-        audio->used = 0;
+    audio->queue_filling = 0;
+
+    /* Hand chunk to encoder thread */
+    if (length > 0) {
+
+        chunk->rate = rate;
+        chunk->channels = channels;
+        chunk->bps = bps;
+        chunk->length = length;
+
+        audio->queue_length++;
+        pthread_cond_signal(&(audio->queue_changed));
 
     }
 
+    pthread_mutex_unlock(&(audio->queue_lock));
+
 }
 
-void audio_stream_write_encoded(audio_stream* audio,
-        unsigned char* data, int length) {
+int audio_stream_queue_pcm(audio_stream* audio, int rate, int channels,
+        int bps, unsigned char* data, int length) {
+
+    unsigned char* buffer = audio_stream_reserve_pcm(audio, length);
+    if (buffer == NULL)
+        return 1;
+
+    memcpy(buffer, data, length);
+    audio_stream_queue_reserved(audio, rate, channels, bps, length);
+
+    return 0;
+
+}
+
+void audio_stream_reserve_encoded(audio_stream* audio, int length) {
 
     /* Resize audio buffer if necessary */
     if (audio->encoded_data_used + length > audio->encoded_data_length) {
 
         /* Increase to double concatenated size to accomodate */
-        audio->encoded_data_length = (audio->encoded_data_length + length)*2;
-        audio->encoded_data = realloc(audio->encoded_data,
-                audio->encoded_data_length);
+        int new_length;
+        unsigned char* new_data = guac_rdp_buffer_alloc(
+                (audio->encoded_data_used + length) * 2, &new_length);
+
+        if (audio->encoded_data != NULL) {
+            memcpy(new_data, audio->encoded_data, audio->encoded_data_used);
+            guac_rdp_buffer_free(audio->encoded_data,
+                    audio->encoded_data_length);
+        }
+
+        audio->encoded_data = new_data;
+        audio->encoded_data_length = new_length;
 
     }
 
-    /* Append to buffer */
-    memcpy(&(audio->encoded_data[audio->encoded_data_used]), data, length);
     audio->encoded_data_used += length;
 
 }
 
+void audio_stream_write_encoded(audio_stream* audio,
+        unsigned char* data, int length) {
+
+    /* Append to buffer */
+    audio_stream_reserve_encoded(audio, length);
+    memcpy(&(audio->encoded_data[audio->encoded_data_used - length]),
+            data, length);
+
+}
+
+/**
+ * Returns whether the given unsigned 8-bit PCM data is silent.
+ */
+int __audio_pcm_silent_u8(const unsigned char* data, int length) {
+
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i midpoint = _mm_set1_epi8((char) 0x80);
+
+    /* Compare sixteen samples at a time */
+    for (; i+16<=length; i+=16) {
+        __m128i samples = _mm_loadu_si128((const __m128i*) (data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(samples, midpoint)) != 0xFFFF)
+            return 0;
+    }
+#endif
+
+    for (; i<length; i++) {
+        if (data[i] != 0x80)
+            return 0;
+    }
+
+    return 1;
+
+}
+
+/**
+ * Returns whether the given signed 16-bit little-endian PCM data is silent.
+ */
+int __audio_pcm_silent_s16(const unsigned char* data, int length) {
+
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i upper = _mm_set1_epi16( GUAC_AUDIO_SILENCE_THRESHOLD);
+    const __m128i lower = _mm_set1_epi16(-GUAC_AUDIO_SILENCE_THRESHOLD);
+
+    /* Test eight samples at a time */
+    for (; i+16<=length; i+=16) {
+
+        __m128i samples = _mm_loadu_si128((const __m128i*) (data + i));
+        __m128i loud = _mm_or_si128(
+                _mm_cmpgt_epi16(samples, upper),
+                _mm_cmplt_epi16(samples, lower));
+
+        if (_mm_movemask_epi8(loud) != 0)
+            return 0;
+
+    }
+#endif
+
+    for (; i+2<=length; i+=2) {
+
+        int sample = (short) (data[i] | (data[i+1] << 8));
+
+        if (sample >  GUAC_AUDIO_SILENCE_THRESHOLD
+         || sample < -GUAC_AUDIO_SILENCE_THRESHOLD)
+            return 0;
+
+    }
+
+    return 1;
+
+}
+
+int audio_pcm_silent(const unsigned char* data, int length, int bps) {
+
+    if (bps == 8)
+        return __audio_pcm_silent_u8(data, length);
+
+    return __audio_pcm_silent_s16(data, length);
+
+}
+
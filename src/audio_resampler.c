@@ -0,0 +1,291 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio_resampler.h"
+
+audio_resampler* audio_resampler_alloc() {
+
+    audio_resampler* resampler =
+        (audio_resampler*) malloc(sizeof(audio_resampler));
+
+    /* No format yet */
+    resampler->in_rate = 0;
+    resampler->in_channels = 0;
+    resampler->in_bps = 0;
+    resampler->out_rate = 0;
+    resampler->out_channels = 0;
+
+    resampler->mapped_length = 0x1000;
+    resampler->mapped = malloc(resampler->mapped_length
+            * AUDIO_RESAMPLER_MAX_CHANNELS * sizeof(int));
+
+    resampler->buffer_length = 0x10000;
+    resampler->buffer = malloc(resampler->buffer_length);
+
+    return resampler;
+
+}
+
+void audio_resampler_free(audio_resampler* resampler) {
+    free(resampler->mapped);
+    free(resampler->buffer);
+    free(resampler);
+}
+
+void audio_resampler_set_format(audio_resampler* resampler,
+        int in_rate, int in_channels, int in_bps,
+        int out_rate, int out_channels) {
+
+    /* Keep state if format unchanged */
+    if (resampler->in_rate == in_rate
+            && resampler->in_channels == in_channels
+            && resampler->in_bps == in_bps
+            && resampler->out_rate == out_rate
+            && resampler->out_channels == out_channels)
+        return;
+
+    resampler->in_rate = in_rate;
+    resampler->in_channels = in_channels;
+    resampler->in_bps = in_bps;
+    resampler->out_rate = out_rate;
+    resampler->out_channels = out_channels;
+
+    /* Average over roughly one output frame when downsampling */
+    resampler->taps = in_rate / out_rate;
+    if (resampler->taps < 1)
+        resampler->taps = 1;
+    else if (resampler->taps > AUDIO_RESAMPLER_MAX_TAPS)
+        resampler->taps = AUDIO_RESAMPLER_MAX_TAPS;
+
+    /* Start from silence */
+    resampler->step = (uint32_t) (((uint64_t) in_rate << 16) / out_rate);
+    resampler->position = 0;
+    resampler->history_index = 0;
+    memset(resampler->last, 0, sizeof(resampler->last));
+    memset(resampler->history, 0, sizeof(resampler->history));
+    memset(resampler->sum, 0, sizeof(resampler->sum));
+
+}
+
+/**
+ * Reads a single input sample as signed 16-bit.
+ */
+int __audio_resampler_sample(audio_resampler* resampler,
+        const unsigned char* frame, int channel) {
+
+    /* 8-bit PCM is unsigned */
+    if (resampler->in_bps == 8)
+        return ((int) frame[channel] - 128) << 8;
+
+    return (int16_t) (frame[channel*2] | (frame[channel*2 + 1] << 8));
+
+}
+
+/**
+ * Reads the value of the given output channel within the given input frame.
+ */
+int __audio_resampler_read(audio_resampler* resampler,
+        const unsigned char* data, int frame, int channel) {
+
+    int in_channels = resampler->in_channels;
+    const unsigned char* current =
+        data + frame * in_channels * resampler->in_bps / 8;
+
+    /* Downmix to mono by averaging all channels */
+    if (resampler->out_channels == 1 && in_channels > 1) {
+
+        int i;
+        int sum = 0;
+
+        for (i=0; i<in_channels; i++)
+            sum += __audio_resampler_sample(resampler, current, i);
+
+        return sum / in_channels;
+
+    }
+
+    /* Otherwise map channels in order, repeating the last if needed */
+    if (channel >= in_channels)
+        channel = in_channels - 1;
+
+    return __audio_resampler_sample(resampler, current, channel);
+
+}
+
+/**
+ * Maps the given input frames to output channels, storing the result in the
+ * mapped frame buffer of the given resampler. If downsampling, each value is
+ * the average of the corresponding channel over the most recent input
+ * frames, continuing from the frames of the previous call. Returns non-zero
+ * if the mapped frame buffer could not be grown.
+ */
+int __audio_resampler_map(audio_resampler* resampler,
+        const unsigned char* data, int frames) {
+
+    int out_channels = resampler->out_channels;
+    int taps = resampler->taps;
+    int* current;
+    int frame, channel;
+
+    /* Grow buffer if necessary */
+    if (frames > resampler->mapped_length) {
+
+        int mapped_length = frames * 2;
+        int* new_mapped = realloc(resampler->mapped, mapped_length
+                * AUDIO_RESAMPLER_MAX_CHANNELS * sizeof(int));
+        if (new_mapped == NULL)
+            return 1;
+
+        resampler->mapped = new_mapped;
+        resampler->mapped_length = mapped_length;
+
+    }
+
+    current = resampler->mapped;
+
+    for (frame=0; frame<frames; frame++) {
+
+        int* oldest = resampler->history[resampler->history_index];
+
+        for (channel=0; channel<out_channels; channel++) {
+
+            int value = __audio_resampler_read(resampler, data, frame,
+                    channel);
+
+            /* Replace oldest frame within moving average */
+            if (taps > 1) {
+                resampler->sum[channel] += value - oldest[channel];
+                oldest[channel] = value;
+                value = resampler->sum[channel] / taps;
+            }
+
+            *(current++) = value;
+
+        }
+
+        if (taps > 1)
+            resampler->history_index =
+                (resampler->history_index + 1) % taps;
+
+    }
+
+    return 0;
+
+}
+
+int audio_resampler_convert(audio_resampler* resampler,
+        const unsigned char* data, int length, unsigned char** output) {
+
+    int out_channels = resampler->out_channels;
+    int frames = length / (resampler->in_channels * resampler->in_bps / 8);
+
+    /* At most one more frame than the exact ratio may be produced */
+    int max_length = (int) ((int64_t) frames * resampler->out_rate
+            / resampler->in_rate + 2) * out_channels * 2;
+
+    unsigned char* current;
+    int* mapped;
+    int channel;
+
+    /* Grow buffer if necessary */
+    if (max_length > resampler->buffer_length) {
+
+        int buffer_length = max_length * 2;
+        unsigned char* new_buffer = realloc(resampler->buffer,
+                buffer_length);
+        if (new_buffer == NULL)
+            return -1;
+
+        resampler->buffer = new_buffer;
+        resampler->buffer_length = buffer_length;
+
+    }
+
+    /* Map and filter all input frames first */
+    if (__audio_resampler_map(resampler, data, frames))
+        return -1;
+
+    mapped = resampler->mapped;
+
+    current = resampler->buffer;
+
+    /* Interpolate each output frame between the two input frames around it,
+     * where input frame -1 is the last frame of the previous call */
+    while ((int) (resampler->position >> 16) < frames) {
+
+        int index = resampler->position >> 16;
+        int fraction = resampler->position & 0xFFFF;
+
+        for (channel=0; channel<out_channels; channel++) {
+
+            int a = index == 0 ? resampler->last[channel]
+                : mapped[(index - 1) * out_channels + channel];
+
+            int b = mapped[index * out_channels + channel];
+
+            int value = a + (int) (((int64_t) (b - a) * fraction) >> 16);
+
+            /* Store as signed 16-bit little-endian */
+            *(current++) = value & 0xFF;
+            *(current++) = (value >> 8) & 0xFF;
+
+        }
+
+        resampler->position += resampler->step;
+
+    }
+
+    /* Continue from last frame in next call */
+    if (frames > 0) {
+
+        resampler->position -= (uint64_t) frames << 16;
+
+        for (channel=0; channel<out_channels; channel++)
+            resampler->last[channel] =
+                mapped[(frames - 1) * out_channels + channel];
+
+    }
+
+    *output = resampler->buffer;
+    return current - resampler->buffer;
+
+}
+
@@ -0,0 +1,150 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "buffer_pool.h"
+
+/**
+ * The free buffers of a single size class.
+ */
+typedef struct guac_rdp_buffer_class {
+
+    /**
+     * All free buffers within this size class.
+     */
+    void* buffers[GUAC_RDP_BUFFER_POOL_MAX_FREE];
+
+    /**
+     * The number of free buffers within this size class.
+     */
+    int count;
+
+} guac_rdp_buffer_class;
+
+/**
+ * Lock guarding all size classes of the buffer pool.
+ */
+pthread_mutex_t __guac_rdp_buffer_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * All size classes of the buffer pool, smallest first.
+ */
+guac_rdp_buffer_class __guac_rdp_buffer_pool[GUAC_RDP_BUFFER_POOL_CLASSES];
+
+/**
+ * Returns the index of the smallest size class which can hold a buffer of
+ * the given size, or -1 if no size class is large enough.
+ */
+int __guac_rdp_buffer_class_index(int size) {
+
+    int index;
+    int class_size = GUAC_RDP_BUFFER_POOL_MIN_SIZE;
+
+    for (index=0; index<GUAC_RDP_BUFFER_POOL_CLASSES; index++) {
+
+        if (size <= class_size)
+            return index;
+
+        class_size <<= 1;
+
+    }
+
+    return -1;
+
+}
+
+void* guac_rdp_buffer_alloc(int size, int* allocated) {
+
+    guac_rdp_buffer_class* buffer_class;
+    void* buffer = NULL;
+
+    int index = __guac_rdp_buffer_class_index(size);
+
+    /* Allocate oversized buffers directly */
+    if (index == -1) {
+        *allocated = size;
+        return malloc(size);
+    }
+
+    *allocated = GUAC_RDP_BUFFER_POOL_MIN_SIZE << index;
+
+    /* Reuse free buffer if available */
+    buffer_class = &(__guac_rdp_buffer_pool[index]);
+
+    pthread_mutex_lock(&__guac_rdp_buffer_pool_lock);
+    if (buffer_class->count > 0)
+        buffer = buffer_class->buffers[--buffer_class->count];
+    pthread_mutex_unlock(&__guac_rdp_buffer_pool_lock);
+
+    if (buffer == NULL)
+        buffer = malloc(*allocated);
+
+    return buffer;
+
+}
+
+void guac_rdp_buffer_free(void* buffer, int allocated) {
+
+    guac_rdp_buffer_class* buffer_class;
+
+    int index = __guac_rdp_buffer_class_index(allocated);
+
+    if (buffer == NULL)
+        return;
+
+    /* Oversized buffers are never pooled */
+    if (index == -1) {
+        free(buffer);
+        return;
+    }
+
+    buffer_class = &(__guac_rdp_buffer_pool[index]);
+
+    /* Keep buffer for reuse only if pool is not full */
+    pthread_mutex_lock(&__guac_rdp_buffer_pool_lock);
+    if (buffer_class->count < GUAC_RDP_BUFFER_POOL_MAX_FREE) {
+        buffer_class->buffers[buffer_class->count++] = buffer;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&__guac_rdp_buffer_pool_lock);
+
+    free(buffer);
+
+}
+
@@ -72,6 +72,10 @@
 #include "ogg_encoder.h"
 #endif
 
+#ifdef ENABLE_OPUS
+#include "opus_encoder.h"
+#endif
+
 #include "client.h"
 #include "guac_handlers.h"
 #include "rdp_keymap.h"
@@ -96,6 +100,12 @@ const char* GUAC_CLIENT_ARGS[] = {
     "console",
     "console-audio",
     "vmconnect",
+    "mouse-rate",
+    "max-fps",
+    "idle-timeout",
+    "audio-rate",
+    "audio-channels",
+    "audio-latency",
     NULL
 };
 
@@ -113,6 +123,12 @@ enum ARGS_IDX {
     IDX_CONSOLE,
     IDX_CONSOLE_AUDIO,
     IDX_VMCONNECT,
+    IDX_MOUSE_RATE,
+    IDX_MAX_FPS,
+    IDX_IDLE_TIMEOUT,
+    IDX_AUDIO_RATE,
+    IDX_AUDIO_CHANNELS,
+    IDX_AUDIO_LATENCY,
 
     RDP_ARGS_COUNT
 };
@@ -151,6 +167,16 @@ BOOL rdp_freerdp_pre_connect(freerdp* instance) {
 
             const char* mimetype = client->info.audio_mimetypes[i];
 
+#ifdef ENABLE_OPUS
+            /* If Opus is supported, done. */
+            if (strcmp(mimetype, opus_encoder->mimetype) == 0) {
+                guac_client_log_info(client, "Loading Ogg Opus encoder.");
+                guac_client_data->audio = audio_stream_alloc(client,
+                        opus_encoder);
+                break;
+            }
+#endif
+
 #ifdef ENABLE_OGG
             /* If Ogg is supported, done. */
             if (strcmp(mimetype, ogg_encoder->mimetype) == 0) {
@@ -174,6 +200,16 @@ BOOL rdp_freerdp_pre_connect(freerdp* instance) {
         /* If an encoding is available, load the sound plugin */
         if (guac_client_data->audio != NULL) {
 
+            /* Convert audio exceeding configured limits */
+            guac_client_data->audio->max_rate =
+                guac_client_data->audio_max_rate;
+            guac_client_data->audio->max_channels =
+                guac_client_data->audio_max_channels;
+
+            /* Gather audio up to the configured latency */
+            guac_client_data->audio->latency =
+                guac_client_data->audio_latency;
+
             /* Load sound plugin */
             if (freerdp_channels_load_plugin(channels, instance->settings,
                         "guacsnd", guac_client_data->audio))
@@ -255,8 +291,10 @@ BOOL rdp_freerdp_pre_connect(freerdp* instance) {
 
     /* Init channels (pre-connect) */
     if (freerdp_channels_pre_connect(channels, instance)) {
-        guac_protocol_send_error(client->socket, "Error initializing RDP client channel manager");
-        guac_socket_flush(client->socket);
+        guac_socket* socket =
+            ((rdp_guac_client_data*) client->data)->output->socket;
+        guac_protocol_send_error(socket, "Error initializing RDP client channel manager");
+        guac_socket_flush(socket);
         return FALSE;
     }
 
@@ -272,8 +310,10 @@ BOOL rdp_freerdp_post_connect(freerdp* instance) {
 
     /* Init channels (post-connect) */
     if (freerdp_channels_post_connect(channels, instance)) {
-        guac_protocol_send_error(client->socket, "Error initializing RDP client channel manager");
-        guac_socket_flush(client->socket);
+        guac_socket* socket =
+            ((rdp_guac_client_data*) client->data)->output->socket;
+        guac_protocol_send_error(socket, "Error initializing RDP client channel manager");
+        guac_socket_flush(socket);
         return FALSE;
     }
 
@@ -337,6 +377,9 @@ int guac_client_init(guac_client* client, int argc, char** argv) {
     int port = RDP_DEFAULT_PORT;
     BOOL BitmapCacheEnabled;
     BOOL portProvided = FALSE;
+    int mouse_rate;
+    int max_fps;
+    int idle_timeout;
 
     /**
      * Selected server-side keymap. Client will be assumed to also use this
@@ -469,10 +512,34 @@ int guac_client_init(guac_client* client, int argc, char** argv) {
                 argv[IDX_WIDTH], settings->ColorDepth);
     }
 
+    /* Maximum mouse motion rate, if specified */
+    mouse_rate = GUAC_RDP_DEFAULT_MOUSE_RATE;
+    if (argv[IDX_MOUSE_RATE][0] != '\0')
+        mouse_rate = atoi(argv[IDX_MOUSE_RATE]);
+
+    /* Maximum frame rate, if specified */
+    max_fps = GUAC_RDP_DEFAULT_MAX_FPS;
+    if (argv[IDX_MAX_FPS][0] != '\0')
+        max_fps = atoi(argv[IDX_MAX_FPS]);
+
+    /* Idle timeout, if specified */
+    idle_timeout = GUAC_RDP_DEFAULT_IDLE_TIMEOUT;
+    if (argv[IDX_IDLE_TIMEOUT][0] != '\0')
+        idle_timeout = atoi(argv[IDX_IDLE_TIMEOUT]);
+
     /* Audio enable/disable */
     guac_client_data->audio_enabled =
         (strcmp(argv[IDX_DISABLE_AUDIO], "true") != 0);
 
+    /* Maximum audio rate and channels, if specified */
+    guac_client_data->audio_max_rate = atoi(argv[IDX_AUDIO_RATE]);
+    guac_client_data->audio_max_channels = atoi(argv[IDX_AUDIO_CHANNELS]);
+
+    /* Audio latency target, if specified */
+    guac_client_data->audio_latency = GUAC_AUDIO_DEFAULT_LATENCY;
+    if (argv[IDX_AUDIO_LATENCY][0] != '\0')
+        guac_client_data->audio_latency = atoi(argv[IDX_AUDIO_LATENCY]);
+
     /* Order support */
     BitmapCacheEnabled = settings->BitmapCacheEnabled;
     settings->OsMajorType = OSMAJORTYPE_UNSPECIFIED;
@@ -529,6 +596,44 @@ int guac_client_init(guac_client* client, int argc, char** argv) {
     memset(guac_client_data->keymap, 0,
             sizeof(guac_rdp_static_keymap));
 
+    /* No pointers cached yet */
+    guac_rdp_pointer_cache_init(guac_client_data->pointer_cache);
+
+    /* Display updates allowed until client falls behind */
+    guac_rdp_flow_init(&(guac_client_data->flow), max_fps, idle_timeout);
+
+    /* Init event loop */
+    if (guac_rdp_event_loop_init(&(guac_client_data->event_loop))) {
+
+        guac_protocol_send_error(client->socket,
+                "Error initializing event loop");
+        guac_socket_flush(client->socket);
+
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Error initializing event loop";
+
+        return 1;
+    }
+
+    /* Init input queue, waking event loop when input is received */
+    if (guac_rdp_input_queue_init(&(guac_client_data->input_queue),
+                mouse_rate)
+            || guac_rdp_event_loop_watch(&(guac_client_data->event_loop),
+                guac_client_data->input_queue.event_fd)) {
+
+        guac_protocol_send_error(client->socket,
+                "Error initializing input queue");
+        guac_socket_flush(client->socket);
+
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Error initializing input queue";
+
+        return 1;
+    }
+
+    /* RDP connection socket not yet known */
+    guac_client_data->rdp_fd = -1;
+
     client->data = guac_client_data;
     ((rdp_freerdp_context*) rdp_inst->context)->client = client;
 
@@ -538,9 +643,32 @@ int guac_client_init(guac_client* client, int argc, char** argv) {
     /* Set server-side keymap */
     settings->KeyboardLayout = chosen_keymap->freerdp_keyboard_layout;
 
+    /* Start writing queued output to client */
+    guac_client_data->output = guac_rdp_output_alloc(client);
+    if (guac_client_data->output == NULL) {
+
+        guac_protocol_send_error(client->socket,
+                "Error starting output thread");
+        guac_socket_flush(client->socket);
+
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Error starting output thread";
+
+        return 1;
+    }
+
     /* Connect to RDP server */
     if (!freerdp_connect(rdp_inst)) {
 
+        /* Stop encoding audio, as the free handler is never installed */
+        if (guac_client_data->audio != NULL) {
+            audio_stream_free(guac_client_data->audio);
+            guac_client_data->audio = NULL;
+        }
+
+        /* Write any queued output before reporting error directly */
+        guac_rdp_output_free(guac_client_data->output);
+
         guac_protocol_send_error(client->socket,
                 "Error connecting to RDP server");
         guac_socket_flush(client->socket);
@@ -551,11 +679,15 @@ int guac_client_init(guac_client* client, int argc, char** argv) {
         return 1;
     }
 
+    pthread_mutex_lock(&(guac_client_data->update_lock));
+
     /* Send connection name */
-    guac_protocol_send_name(client->socket, settings->WindowTitle);
+    guac_protocol_send_name(guac_client_data->output->socket,
+            settings->WindowTitle);
 
     /* Send size */
-    guac_protocol_send_size(client->socket, GUAC_DEFAULT_LAYER,
+    guac_protocol_send_size(guac_client_data->output->socket,
+            GUAC_DEFAULT_LAYER,
             settings->DesktopWidth, settings->DesktopHeight);
 
     /* Create glyph surfaces */
@@ -565,8 +697,30 @@ int guac_client_init(guac_client* client, int argc, char** argv) {
     guac_client_data->trans_glyph_surface = cairo_image_surface_create(
             CAIRO_FORMAT_ARGB32, settings->DesktopWidth, settings->DesktopHeight);
 
+    /* Upload default pointer */
+    guac_client_data->default_pointer = guac_client_alloc_buffer(client);
+    guac_rdp_send_default_pointer(client, guac_client_data->default_pointer);
+
+    /* Upload transparent pointer */
+    guac_client_data->null_pointer = guac_client_alloc_buffer(client);
+    guac_protocol_send_rect(guac_client_data->output->socket,
+            guac_client_data->null_pointer, 0, 0, 1, 1);
+    guac_protocol_send_cfill(guac_client_data->output->socket,
+            GUAC_COMP_SRC, guac_client_data->null_pointer,
+            0x00, 0x00, 0x00, 0x00);
+
+    /* Cursor instructions must follow the pointer images */
+    guac_client_data->pointer_mark =
+        guac_rdp_output_mark(guac_client_data->output);
+
     /* Set default pointer */
-    guac_rdp_set_default_pointer(client);
+    guac_rdp_pointer_set_default(rdp_inst->context);
+
+    guac_socket_flush(guac_client_data->output->socket);
+    pthread_mutex_unlock(&(guac_client_data->update_lock));
+
+    /* Leave the client's socket to guacd until messages are handled */
+    guac_rdp_output_pause(guac_client_data->output, 0);
 
     /* Success */
     return 0;
@@ -35,11 +35,16 @@
  *
  * ***** END LICENSE BLOCK ***** */
 
+#include <pthread.h>
+
 #include <cairo/cairo.h>
 #include <guacamole/client.h>
 #include <guacamole/protocol.h>
 #include <guacamole/socket.h>
 
+#include "client.h"
+#include "guac_png.h"
+
 /* Macros for prettying up the embedded image. */
 #define X 0x00,0x00,0x00,0xFF
 #define O 0xFF,0xFF,0xFF,0xFF
@@ -76,12 +81,11 @@ unsigned char guac_rdp_default_pointer[] = {
 };
 
 
-void guac_rdp_set_default_pointer(guac_client* client) {
-
-    guac_socket* socket = client->socket;
+/* Embedded pointer graphic, encoded as PNG only once per process */
+static pthread_once_t guac_rdp_default_pointer_png_once = PTHREAD_ONCE_INIT;
+static guac_rdp_png_buffer guac_rdp_default_pointer_png;
 
-    /* Draw to buffer */
-    guac_layer* cursor = guac_client_alloc_buffer(client);
+void __guac_rdp_default_pointer_encode() {
 
     cairo_surface_t* graphic = cairo_image_surface_create_for_data(
             guac_rdp_default_pointer,
@@ -90,17 +94,40 @@ void guac_rdp_set_default_pointer(guac_client* client) {
             guac_rdp_default_pointer_height,
             guac_rdp_default_pointer_stride);
 
-    guac_protocol_send_png(socket, GUAC_COMP_SRC, cursor, 0, 0, graphic);
+    /* If encoding fails, buffer will be left empty */
+    guac_rdp_png_encode(graphic, &guac_rdp_default_pointer_png);
     cairo_surface_destroy(graphic);
 
-    /* Set cursor */
-    guac_protocol_send_cursor(socket, 0, 0, cursor,
-            0, 0,
-            guac_rdp_default_pointer_width,
-            guac_rdp_default_pointer_height);
+}
+
+void guac_rdp_send_default_pointer(guac_client* client, guac_layer* layer) {
+
+    guac_socket* socket =
+        ((rdp_guac_client_data*) client->data)->output->socket;
+
+    /* Encode pointer if not yet encoded */
+    pthread_once(&guac_rdp_default_pointer_png_once,
+            __guac_rdp_default_pointer_encode);
+
+    /* Send pre-encoded image if available */
+    if (guac_rdp_default_pointer_png.length > 0)
+        guac_rdp_send_png_buffer(socket, GUAC_COMP_SRC, layer, 0, 0,
+                &guac_rdp_default_pointer_png);
+
+    /* Otherwise, fall back to encoding now */
+    else {
+
+        cairo_surface_t* graphic = cairo_image_surface_create_for_data(
+                guac_rdp_default_pointer,
+                guac_rdp_default_pointer_format,
+                guac_rdp_default_pointer_width,
+                guac_rdp_default_pointer_height,
+                guac_rdp_default_pointer_stride);
+
+        guac_protocol_send_png(socket, GUAC_COMP_SRC, layer, 0, 0, graphic);
+        cairo_surface_destroy(graphic);
 
-    /* Free buffer */
-    guac_client_free_buffer(client, cursor);
+    }
 
 }
 
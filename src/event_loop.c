@@ -0,0 +1,289 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include <guacamole/protocol.h>
+
+#include "event_loop.h"
+
+int guac_rdp_event_loop_init(guac_rdp_event_loop* loop) {
+
+    struct epoll_event event;
+
+    loop->fd_count = 0;
+    loop->timer_deadline = 0;
+    loop->timer_expired = 0;
+
+    /* Create epoll instance */
+    loop->epoll_fd = epoll_create(GUAC_RDP_EVENT_LOOP_MAX_FDS);
+    if (loop->epoll_fd == -1)
+        return 1;
+
+    /* Create timer */
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (loop->timer_fd == -1) {
+        close(loop->epoll_fd);
+        return 1;
+    }
+
+    /* Watch timer permanently */
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = loop->timer_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event)) {
+        close(loop->timer_fd);
+        close(loop->epoll_fd);
+        return 1;
+    }
+
+    return 0;
+
+}
+
+void guac_rdp_event_loop_destroy(guac_rdp_event_loop* loop) {
+    close(loop->timer_fd);
+    close(loop->epoll_fd);
+}
+
+int guac_rdp_event_loop_watch(guac_rdp_event_loop* loop, int fd) {
+
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0;
+
+}
+
+/**
+ * Adds the given events to the given list of watched file descriptors,
+ * merging with any existing entry for the same file descriptor. Returns the
+ * new number of entries, or -1 if there is no room for another entry.
+ */
+int __guac_rdp_event_loop_add(guac_rdp_event_loop_fd* fds, int count,
+        int fd, unsigned int events) {
+
+    int i;
+
+    /* Merge with existing entry if present */
+    for (i=0; i<count; i++) {
+        if (fds[i].fd == fd) {
+            fds[i].events |= events;
+            return count;
+        }
+    }
+
+    /* Fail if no room remains */
+    if (count >= GUAC_RDP_EVENT_LOOP_MAX_FDS)
+        return -1;
+
+    /* Otherwise, add new entry */
+    fds[count].fd = fd;
+    fds[count].events = events;
+    return count + 1;
+
+}
+
+int guac_rdp_event_loop_update_fds(guac_rdp_event_loop* loop,
+        void** read_fds, int read_count, void** write_fds, int write_count) {
+
+    guac_rdp_event_loop_fd wanted[GUAC_RDP_EVENT_LOOP_MAX_FDS];
+    int wanted_count = 0;
+    int i, j;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+
+    /* Build list of file descriptors which should be watched */
+    for (i=0; i<read_count && wanted_count != -1; i++)
+        wanted_count = __guac_rdp_event_loop_add(wanted, wanted_count,
+                (int)(long) (read_fds[i]), EPOLLIN);
+
+    for (i=0; i<write_count && wanted_count != -1; i++)
+        wanted_count = __guac_rdp_event_loop_add(wanted, wanted_count,
+                (int)(long) (write_fds[i]), EPOLLOUT);
+
+    /* Refuse to silently ignore descriptors */
+    if (wanted_count == -1) {
+        errno = EMFILE;
+        return 1;
+    }
+
+    /* Remove registrations which are no longer wanted */
+    for (i=0; i<loop->fd_count; i++) {
+
+        guac_rdp_event_loop_fd* current = &(loop->fds[i]);
+
+        /* Find corresponding wanted entry */
+        for (j=0; j<wanted_count; j++) {
+            if (wanted[j].fd == current->fd)
+                break;
+        }
+
+        /* The descriptor may already have been closed */
+        if (j == wanted_count
+                && epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, current->fd, &event)
+                && errno != EBADF && errno != ENOENT)
+            return 1;
+
+    }
+
+    /* Register only new or changed descriptors */
+    for (i=0; i<wanted_count; i++) {
+
+        int op = EPOLL_CTL_ADD;
+
+        /* Find corresponding current entry */
+        for (j=0; j<loop->fd_count; j++) {
+            if (loop->fds[j].fd == wanted[i].fd)
+                break;
+        }
+
+        if (j < loop->fd_count) {
+
+            /* Leave unchanged registrations alone */
+            if (loop->fds[j].events == wanted[i].events)
+                continue;
+
+            op = EPOLL_CTL_MOD;
+
+        }
+
+        event.events = wanted[i].events;
+        event.data.fd = wanted[i].fd;
+
+        /* A descriptor marked for re-registration may have been closed and
+         * its number reused, dropping it from the epoll set */
+        if (epoll_ctl(loop->epoll_fd, op, wanted[i].fd, &event)) {
+
+            if (op == EPOLL_CTL_MOD && errno == ENOENT)
+                op = EPOLL_CTL_ADD;
+            else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+                op = EPOLL_CTL_MOD;
+            else
+                return 1;
+
+            if (epoll_ctl(loop->epoll_fd, op, wanted[i].fd, &event))
+                return 1;
+
+        }
+
+    }
+
+    /* Store new registrations */
+    memcpy(loop->fds, wanted, sizeof(guac_rdp_event_loop_fd) * wanted_count);
+    loop->fd_count = wanted_count;
+
+    return 0;
+
+}
+
+int guac_rdp_event_loop_wait(guac_rdp_event_loop* loop, int timeout) {
+
+    struct epoll_event events[GUAC_RDP_EVENT_LOOP_MAX_FDS + 1];
+    int count;
+    int i;
+
+    loop->timer_expired = 0;
+
+    /* Wait for events */
+    count = epoll_wait(loop->epoll_fd, events,
+            GUAC_RDP_EVENT_LOOP_MAX_FDS + 1, timeout);
+
+    /* Check whether the timer is among the ready descriptors */
+    for (i=0; i<count; i++) {
+
+        /* Re-register any descriptor reporting an error or hangup during the
+         * next update, as it may since have been closed and reused */
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+
+            int j;
+            for (j=0; j<loop->fd_count; j++) {
+                if (loop->fds[j].fd == events[i].data.fd)
+                    loop->fds[j].events = 0;
+            }
+
+        }
+
+        if (events[i].data.fd == loop->timer_fd) {
+
+            /* Acknowledge expiration */
+            uint64_t expirations;
+            if (read(loop->timer_fd, &expirations, sizeof(expirations)) > 0) {
+                loop->timer_deadline = 0;
+                loop->timer_expired = 1;
+            }
+
+        }
+
+    }
+
+    return count;
+
+}
+
+void guac_rdp_event_loop_schedule(guac_rdp_event_loop* loop, int msecs) {
+
+    struct itimerspec timer;
+    guac_timestamp deadline = guac_protocol_get_timestamp() + msecs;
+
+    /* Do nothing if a sooner wakeup is already scheduled */
+    if (loop->timer_deadline != 0 && loop->timer_deadline <= deadline)
+        return;
+
+    /* Arm one-shot timer. A zero value would disarm the timer. */
+    if (msecs <= 0)
+        msecs = 1;
+
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec  = msecs / 1000;
+    timer.it_value.tv_nsec = (msecs % 1000) * 1000000;
+
+    if (timerfd_settime(loop->timer_fd, 0, &timer, NULL) == 0)
+        loop->timer_deadline = deadline;
+
+}
+
@@ -0,0 +1,420 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdint.h>
+
+#include <freerdp/freerdp.h>
+
+#include <guacamole/client.h>
+#include <guacamole/protocol.h>
+
+#include "audio.h"
+#include "client.h"
+#include "event_loop.h"
+#include "flow_control.h"
+#include "output.h"
+
+/**
+ * Settings for each quality level, indexed by guac_rdp_quality.
+ */
+const guac_rdp_quality_settings __guac_rdp_quality_levels[] = {
+    { 100, 0.0 },                       /* GUAC_RDP_QUALITY_LOW */
+    {  50, 0.2 },                       /* GUAC_RDP_QUALITY_MEDIUM */
+    {   0, GUAC_AUDIO_DEFAULT_QUALITY } /* GUAC_RDP_QUALITY_HIGH */
+};
+
+/**
+ * Human-readable names of each quality level, indexed by guac_rdp_quality.
+ */
+const char* __guac_rdp_quality_names[] = {
+    "low",
+    "medium",
+    "high"
+};
+
+void guac_rdp_flow_init(guac_rdp_flow_control* flow, int max_fps,
+        int idle_timeout) {
+
+    flow->suppressed = 0;
+    flow->suppressed_since = 0;
+
+    flow->base_frame_interval = max_fps > 0 ? 1000 / max_fps : 0;
+    flow->frame_interval = flow->base_frame_interval;
+    flow->last_frame = 0;
+    flow->frame_pending = 0;
+
+    flow->last_ack = 0;
+    flow->last_update = 0;
+    flow->frame_rtt = 0;
+    flow->rtt = 0;
+
+    flow->idle_timeout = idle_timeout * 1000;
+    flow->last_input = guac_protocol_get_timestamp();
+
+    /* Assume a fast connection until shown otherwise */
+    flow->last_estimate = guac_protocol_get_timestamp();
+    flow->last_bytes_written = 0;
+    flow->bandwidth = 0;
+    flow->quality = GUAC_RDP_QUALITY_HIGH;
+    flow->upgrade_estimates = 0;
+
+}
+
+int guac_rdp_flow_lag(guac_client* client) {
+
+    /* Syncs are sent with their timestamp and echoed back once the client
+     * has processed everything before them */
+    int lag = client->last_sent_timestamp - client->last_received_timestamp;
+
+    if (lag < 0)
+        return 0;
+
+    return lag;
+
+}
+
+void guac_rdp_flow_suppress(guac_client* client, int reason) {
+
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_rdp_flow_control* flow = &(data->flow);
+
+    /* Ask server to stop sending updates only on the first reason */
+    if (flow->suppressed == 0) {
+
+#ifdef HAVE_RDPUPDATE_SUPPRESSOUTPUT
+        rdpUpdate* update = data->rdp_inst->update;
+        update->SuppressOutput(data->rdp_inst->context, 0, NULL);
+#endif
+
+        flow->suppressed_since = guac_protocol_get_timestamp();
+        guac_client_log_info(client, "Display updates suppressed (0x%x)",
+                reason);
+
+    }
+
+    flow->suppressed |= reason;
+
+}
+
+void guac_rdp_flow_resume(guac_client* client, int reason) {
+
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_rdp_flow_control* flow = &(data->flow);
+
+    /* Nothing to do if not suppressed for this reason */
+    if (!(flow->suppressed & reason))
+        return;
+
+    flow->suppressed &= ~reason;
+
+    /* Resume and refresh entire display once no reason remains */
+    if (flow->suppressed == 0) {
+
+#if defined(HAVE_RDPUPDATE_SUPPRESSOUTPUT) || defined(HAVE_RDPUPDATE_REFRESHRECT)
+        rdpSettings* settings = data->rdp_inst->settings;
+        rdpUpdate* update = data->rdp_inst->update;
+
+        RECTANGLE_16 area;
+        area.left   = 0;
+        area.top    = 0;
+        area.right  = settings->DesktopWidth - 1;
+        area.bottom = settings->DesktopHeight - 1;
+#endif
+
+#ifdef HAVE_RDPUPDATE_SUPPRESSOUTPUT
+        update->SuppressOutput(data->rdp_inst->context, 1, &area);
+#endif
+
+#ifdef HAVE_RDPUPDATE_REFRESHRECT
+        update->RefreshRect(data->rdp_inst->context, 1, &area);
+#endif
+
+        guac_client_log_info(client,
+                "Display updates resumed after %i ms",
+                (int) (guac_protocol_get_timestamp()
+                    - flow->suppressed_since));
+
+    }
+
+}
+
+/**
+ * Terminates the current frame with a sync instruction and flushes all
+ * updates to the output queue.
+ */
+void __guac_rdp_flow_send_frame(guac_client* client) {
+
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_rdp_flow_control* flow = &(data->flow);
+
+    guac_timestamp timestamp = guac_protocol_get_timestamp();
+
+    pthread_mutex_lock(&(data->update_lock));
+    guac_protocol_send_sync(data->output->socket, timestamp);
+    guac_socket_flush(data->output->socket);
+    client->last_sent_timestamp = timestamp;
+    pthread_mutex_unlock(&(data->update_lock));
+
+    flow->last_frame = timestamp;
+    flow->frame_pending = 0;
+
+}
+
+/**
+ * Returns the number of milliseconds until the next frame may be sent, or
+ * zero if a frame may be sent now.
+ */
+int __guac_rdp_flow_frame_delay(guac_rdp_flow_control* flow) {
+
+    int elapsed = guac_protocol_get_timestamp() - flow->last_frame;
+
+    if (elapsed >= flow->frame_interval || elapsed < 0)
+        return 0;
+
+    return flow->frame_interval - elapsed;
+
+}
+
+void guac_rdp_flow_end_frame(guac_client* client) {
+
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_rdp_flow_control* flow = &(data->flow);
+
+    int delay;
+
+    flow->frame_pending = 1;
+
+    /* Hold frames back entirely while the client is behind */
+    if (flow->suppressed & GUAC_RDP_SUPPRESS_BACKPRESSURE)
+        return;
+
+    /* Send frame now if allowed, otherwise wake once it is due */
+    delay = __guac_rdp_flow_frame_delay(flow);
+    if (delay == 0)
+        __guac_rdp_flow_send_frame(client);
+    else
+        guac_rdp_event_loop_schedule(&(data->event_loop), delay);
+
+}
+
+void guac_rdp_flow_input_received(guac_rdp_flow_control* flow) {
+    flow->last_input = guac_protocol_get_timestamp();
+}
+
+/**
+ * Returns non-zero if the given client is idle, having neither sent input
+ * nor acknowledged any frame within the idle timeout.
+ */
+int __guac_rdp_flow_is_idle(guac_client* client, guac_timestamp now) {
+
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_rdp_flow_control* flow = &(data->flow);
+
+    if (flow->idle_timeout == 0)
+        return 0;
+
+    return now - flow->last_input >= flow->idle_timeout
+        && now - client->last_received_timestamp >= flow->idle_timeout;
+
+}
+
+/**
+ * Returns the quality level appropriate for the given bandwidth and round
+ * trip time.
+ */
+guac_rdp_quality __guac_rdp_flow_select_quality(int bandwidth, int rtt) {
+
+    /* Slow or distant */
+    if ((bandwidth != 0 && bandwidth < 100000) || rtt > 300)
+        return GUAC_RDP_QUALITY_LOW;
+
+    /* Fast (or not yet limited) and near */
+    if ((bandwidth == 0 || bandwidth >= 1000000) && rtt <= 100)
+        return GUAC_RDP_QUALITY_HIGH;
+
+    return GUAC_RDP_QUALITY_MEDIUM;
+
+}
+
+/**
+ * Applies the settings of the given quality level to the given client.
+ */
+void __guac_rdp_flow_set_quality(guac_client* client,
+        guac_rdp_quality quality) {
+
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_rdp_flow_control* flow = &(data->flow);
+
+    const guac_rdp_quality_settings* settings =
+        &(__guac_rdp_quality_levels[quality]);
+
+    flow->quality = quality;
+
+    /* Never exceed configured frame rate */
+    flow->frame_interval = flow->base_frame_interval;
+    if (settings->frame_interval > flow->frame_interval)
+        flow->frame_interval = settings->frame_interval;
+
+    /* Audio quality takes effect with the next audio chunk */
+    if (data->audio != NULL)
+        data->audio->quality = settings->audio_quality;
+
+    guac_client_log_info(client,
+            "Quality level changed to %s (bandwidth %i B/s, RTT %i ms)",
+            __guac_rdp_quality_names[quality], flow->bandwidth, flow->rtt);
+
+}
+
+/**
+ * Updates the bandwidth estimate of the given client from the data written
+ * since the last estimate, changing quality level if necessary.
+ */
+void __guac_rdp_flow_estimate(guac_client* client, int elapsed, int queued) {
+
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_rdp_flow_control* flow = &(data->flow);
+
+    int64_t bytes_written = data->output->bytes_written;
+    int throughput = (int) ((bytes_written - flow->last_bytes_written)
+                   * 1000 / elapsed);
+
+    guac_rdp_quality quality;
+
+    flow->last_bytes_written = bytes_written;
+
+    /* If data remained queued throughout, throughput is the bandwidth */
+    if (queued >= GUAC_RDP_FLOW_SATURATED) {
+        if (flow->bandwidth == 0)
+            flow->bandwidth = throughput;
+        else
+            flow->bandwidth = (flow->bandwidth * 3 + throughput) / 4;
+    }
+
+    /* Otherwise, the bandwidth is at least the throughput */
+    else if (flow->bandwidth != 0 && throughput > flow->bandwidth)
+        flow->bandwidth = throughput;
+
+    quality = __guac_rdp_flow_select_quality(flow->bandwidth, flow->rtt);
+
+    /* Lower quality immediately */
+    if (quality < flow->quality) {
+        flow->upgrade_estimates = 0;
+        __guac_rdp_flow_set_quality(client, quality);
+    }
+
+    /* Raise quality only once consistently allowed */
+    else if (quality > flow->quality) {
+        if (++flow->upgrade_estimates >= GUAC_RDP_FLOW_UPGRADE_ESTIMATES) {
+            flow->upgrade_estimates = 0;
+            __guac_rdp_flow_set_quality(client, flow->quality + 1);
+        }
+    }
+
+    else
+        flow->upgrade_estimates = 0;
+
+}
+
+void guac_rdp_flow_update(guac_client* client) {
+
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_rdp_flow_control* flow = &(data->flow);
+
+    guac_timestamp now = guac_protocol_get_timestamp();
+    guac_timestamp ack = client->last_received_timestamp;
+
+    int lag;
+    int queued;
+
+    /* Measure round trip of newly acknowledged frame, unless too long has
+     * passed since the acknowledgement could last have been noticed */
+    if (ack != flow->last_ack && ack != 0
+            && flow->last_update != 0
+            && now - flow->last_update <= GUAC_RDP_FLOW_RTT_MAX_ERROR) {
+
+        flow->frame_rtt = now - ack;
+
+        if (flow->rtt == 0)
+            flow->rtt = flow->frame_rtt;
+        else
+            flow->rtt = (flow->rtt * 7 + flow->frame_rtt) / 8;
+
+    }
+
+    flow->last_ack = ack;
+    flow->last_update = now;
+
+    /* Send pending frame once due, unless client is behind */
+    if (flow->frame_pending
+            && !(flow->suppressed & GUAC_RDP_SUPPRESS_BACKPRESSURE)
+            && __guac_rdp_flow_frame_delay(flow) == 0)
+        __guac_rdp_flow_send_frame(client);
+
+    /* Otherwise, keep the client's sync timestamps current */
+    else if (now - client->last_sent_timestamp
+            >= GUAC_RDP_OUTPUT_SYNC_INTERVAL)
+        __guac_rdp_flow_send_frame(client);
+
+    lag = guac_rdp_flow_lag(client);
+    queued = guac_rdp_output_queued(data->output);
+
+    /* Periodically re-estimate bandwidth and quality */
+    if (now - flow->last_estimate >= GUAC_RDP_FLOW_ESTIMATE_INTERVAL) {
+        __guac_rdp_flow_estimate(client, now - flow->last_estimate, queued);
+        flow->last_estimate = now;
+    }
+
+    /* Suppress updates if client is falling behind */
+    if (!(flow->suppressed & GUAC_RDP_SUPPRESS_BACKPRESSURE)) {
+        if (lag > GUAC_RDP_FLOW_MAX_LAG
+                || queued > GUAC_RDP_FLOW_HIGH_WATERMARK)
+            guac_rdp_flow_suppress(client, GUAC_RDP_SUPPRESS_BACKPRESSURE);
+    }
+
+    /* Resume once client has caught up */
+    else if (lag <= GUAC_RDP_FLOW_RESUME_LAG
+            && queued <= GUAC_RDP_FLOW_LOW_WATERMARK)
+        guac_rdp_flow_resume(client, GUAC_RDP_SUPPRESS_BACKPRESSURE);
+
+    /* Suppress updates while nobody is using the client */
+    if (__guac_rdp_flow_is_idle(client, now))
+        guac_rdp_flow_suppress(client, GUAC_RDP_SUPPRESS_IDLE);
+    else
+        guac_rdp_flow_resume(client, GUAC_RDP_SUPPRESS_IDLE);
+
+}
+
@@ -43,7 +43,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <sys/select.h>
 #include <errno.h>
 
 #include <freerdp/freerdp.h>
@@ -63,9 +62,46 @@
 #include "rdp_keymap.h"
 #include "rdp_cliprdr.h"
 #include "guac_handlers.h"
+#include "input_queue.h"
+
+void __guac_rdp_update_keysyms(guac_client* client, guac_rdp_input_batch* batch,
+        const int* keysym_string, int from, int to);
+int __guac_rdp_send_keysym(guac_client* client, guac_rdp_input_batch* batch,
+        int keysym, int pressed);
+
+/**
+ * Handlers for all supported classes of channel events, terminated by an
+ * entry with a NULL handler.
+ */
+guac_rdp_channel_event_mapping __guac_rdp_channel_event_handlers[] = {
+    { RDP_EVENT_CLASS_CLIPRDR, guac_rdp_process_cliprdr_event },
+    { 0, NULL }
+};
+
+/**
+ * Dispatches the given channel event to the handler for its class, if any.
+ */
+void __guac_rdp_dispatch_channel_event(guac_client* client, RDP_EVENT* event) {
+
+    guac_rdp_channel_event_mapping* mapping =
+        __guac_rdp_channel_event_handlers;
+
+    /* Find handler for event class */
+    while (mapping->handler != NULL) {
+
+        if (mapping->event_class == event->event_class) {
+            mapping->handler(client, event);
+            return;
+        }
+
+        mapping++;
+
+    }
+
+    guac_client_log_info(client, "Ignoring unsupported channel event "
+            "(class=0x%x, type=0x%x)", event->event_class, event->event_type);
 
-void __guac_rdp_update_keysyms(guac_client* client, const int* keysym_string, int from, int to);
-int __guac_rdp_send_keysym(guac_client* client, int keysym, int pressed);
+}
 
 
 int rdp_guac_client_free_handler(guac_client* client) {
@@ -82,9 +118,19 @@ int rdp_guac_client_free_handler(guac_client* client) {
 	freerdp_disconnect(rdp_inst);
     freerdp_clrconv_free(((rdp_freerdp_context*) rdp_inst->context)->clrconv);
     cache_free(rdp_inst->context->cache);
+    guac_rdp_pointer_cache_free(guac_client_data->pointer_cache);
     freerdp_free(rdp_inst);
 
+    /* Free audio stream, if any, stopping its use of the output */
+    if (guac_client_data->audio != NULL)
+        audio_stream_free(guac_client_data->audio);
+
+    /* Write any remaining output */
+    guac_rdp_output_free(guac_client_data->output);
+
     /* Free client data */
+    guac_rdp_input_queue_destroy(&(guac_client_data->input_queue));
+    guac_rdp_event_loop_destroy(&(guac_client_data->event_loop));
     cairo_surface_destroy(guac_client_data->opaque_glyph_surface);
     cairo_surface_destroy(guac_client_data->trans_glyph_surface);
     free(guac_client_data->clipboard);
@@ -94,25 +140,23 @@ int rdp_guac_client_free_handler(guac_client* client) {
 
 }
 
-int rdp_guac_client_handle_messages(guac_client* client) {
+/**
+ * Waits for and handles all pending RDP and channel data, sending any
+ * resulting updates through the output queue.
+ */
+int __guac_rdp_handle_messages(guac_client* client) {
 
     rdp_guac_client_data* guac_client_data = (rdp_guac_client_data*) client->data;
     freerdp* rdp_inst = guac_client_data->rdp_inst;
     rdpChannels* channels = rdp_inst->context->channels;
+    int motion_delay;
+    int rdp_fd;
 
-    int index;
-    int max_fd, fd;
-    void* read_fds[32];
-    void* write_fds[32];
+    void* read_fds[GUAC_RDP_EVENT_LOOP_MAX_FDS];
+    void* write_fds[GUAC_RDP_EVENT_LOOP_MAX_FDS];
     int read_count = 0;
     int write_count = 0;
-    fd_set rfds, wfds;
-    RDP_EVENT* event;
-
-    struct timeval timeout = {
-        .tv_sec = 0,
-        .tv_usec = 250000
-    };
+    int event_count;
 
     /* get rdp fds */
     if (!freerdp_get_fds(rdp_inst, read_fds, &read_count, write_fds, &write_count)) {
@@ -121,6 +165,10 @@ int rdp_guac_client_handle_messages(guac_client* client) {
         return 1;
     }
 
+    /* The RDP connection socket is always the first fd */
+    rdp_fd = read_count > 0 ? (int) (long) read_fds[0] : -1;
+    guac_client_data->rdp_fd = rdp_fd;
+
     /* get channel fds */
     if (!freerdp_channels_get_fds(channels, rdp_inst, read_fds, &read_count, write_fds, &write_count)) {
         guac_error = GUAC_STATUS_BAD_STATE;
@@ -128,40 +176,27 @@ int rdp_guac_client_handle_messages(guac_client* client) {
         return 1;
     }
 
-    /* Construct read fd_set */
-    max_fd = 0;
-    FD_ZERO(&rfds);
-    for (index = 0; index < read_count; index++) {
-        fd = (int)(long) (read_fds[index]);
-        if (fd > max_fd)
-            max_fd = fd;
-        FD_SET(fd, &rfds);
-    }
-
-    /* Construct write fd_set */
-    FD_ZERO(&wfds);
-    for (index = 0; index < write_count; index++) {
-        fd = (int)(long) (write_fds[index]);
-        if (fd > max_fd)
-            max_fd = fd;
-        FD_SET(fd, &wfds);
-    }
-
     /* If no file descriptors, error */
-    if (max_fd == 0) {
+    if (read_count + write_count == 0) {
         guac_error = GUAC_STATUS_BAD_STATE;
         guac_error_message = "No file descriptors";
         return 1;
     }
 
-    /* Otherwise, wait for file descriptors given */
-    if (select(max_fd + 1, &rfds, &wfds, NULL, &timeout) == -1) {
-        /* these are not really errors */
-        if (!((errno == EAGAIN) ||
-            (errno == EWOULDBLOCK) ||
-            (errno == EINPROGRESS) ||
-            (errno == EINTR))) /* signal occurred */
-        {
+    /* Register any new or changed file descriptors */
+    if (guac_rdp_event_loop_update_fds(&(guac_client_data->event_loop),
+                read_fds, read_count, write_fds, write_count)) {
+        guac_error = GUAC_STATUS_SEE_ERRNO;
+        guac_error_message = "Unable to watch RDP file descriptors";
+        return 1;
+    }
+
+    /* Wait for file descriptors or timer */
+    if (guac_rdp_event_loop_wait(&(guac_client_data->event_loop),
+                GUAC_RDP_EVENT_LOOP_TIMEOUT) == -1) {
+
+        /* Interruption by a signal is not really an error */
+        if (errno != EINTR) {
             guac_error = GUAC_STATUS_SEE_ERRNO;
             guac_error_message = "Error waiting for file descriptor";
             return 1;
@@ -170,6 +205,10 @@ int rdp_guac_client_handle_messages(guac_client* client) {
 
     pthread_mutex_lock(&(guac_client_data->rdp_lock));
 
+    /* Send any pending input before handling received data */
+    guac_rdp_input_queue_drain(&(guac_client_data->input_queue), rdp_inst,
+            rdp_fd);
+
     /* Check the libfreerdp fds */
     if (!freerdp_check_fds(rdp_inst)) {
         guac_error = GUAC_STATUS_BAD_STATE;
@@ -184,18 +223,36 @@ int rdp_guac_client_handle_messages(guac_client* client) {
         return 1;
     }
 
-    /* Check for channel events */
-    event = freerdp_channels_pop_event(channels);
-    if (event) {
+    /* Send any input received while handling data */
+    motion_delay = guac_rdp_input_queue_drain(
+            &(guac_client_data->input_queue), rdp_inst, rdp_fd);
+
+    /* Wake to send coalesced mouse motion once allowed */
+    if (motion_delay >= 0)
+        guac_rdp_event_loop_schedule(&(guac_client_data->event_loop),
+                motion_delay);
 
-        /* Handle clipboard events */
-        if (event->event_class == RDP_EVENT_CLASS_CLIPRDR)
-            guac_rdp_process_cliprdr_event(client, event);
+    /* Handle all pending channel events, up to a fair limit */
+    for (event_count = 0; event_count < GUAC_RDP_MAX_CHANNEL_EVENTS;
+            event_count++) {
 
+        RDP_EVENT* event = freerdp_channels_pop_event(channels);
+        if (event == NULL)
+            break;
+
+        __guac_rdp_dispatch_channel_event(client, event);
         freerdp_event_free(event);
 
     }
 
+    /* If events may remain, handle them next iteration without waiting */
+    if (event_count == GUAC_RDP_MAX_CHANNEL_EVENTS)
+        guac_rdp_event_loop_schedule(&(guac_client_data->event_loop), 0);
+
+    /* Send any due frame, and suppress or resume display updates depending
+     * on client lag */
+    guac_rdp_flow_update(client);
+
     /* Handle RDP disconnect */
     if (freerdp_shall_disconnect(rdp_inst)) {
         guac_error = GUAC_STATUS_NO_INPUT;
@@ -205,28 +262,52 @@ int rdp_guac_client_handle_messages(guac_client* client) {
 
     pthread_mutex_unlock(&(guac_client_data->rdp_lock));
 
-    /* Flush any audio */
-    if (guac_client_data->audio != NULL) {
-        pthread_mutex_lock(&(guac_client_data->update_lock));
-        guac_socket_flush(guac_client_data->audio->stream->socket);
-        pthread_mutex_unlock(&(guac_client_data->update_lock));
-    }
-
     /* Success */
     return 0;
 
 }
 
+int rdp_guac_client_handle_messages(guac_client* client) {
+
+    rdp_guac_client_data* guac_client_data = (rdp_guac_client_data*) client->data;
+    guac_rdp_output* output = guac_client_data->output;
+    int retval;
+
+    /* guacd writes to the client's socket only outside this handler */
+    guac_rdp_output_resume(output);
+
+    retval = __guac_rdp_handle_messages(client);
+
+    /* Queue the remainder of any instruction the writer thread may be
+     * partway through */
+    pthread_mutex_lock(&(guac_client_data->update_lock));
+    guac_socket_flush(output->socket);
+    guac_socket_flush(output->cursor_socket);
+    pthread_mutex_unlock(&(guac_client_data->update_lock));
+
+    /* Past this lag, guacd stops calling this handler until the client
+     * acknowledges the last sync, so that sync must actually be sent */
+    guac_rdp_output_pause(output,
+            guac_rdp_flow_lag(client) >= GUAC_RDP_OUTPUT_SYNC_THRESHOLD);
+
+    return retval;
+
+}
+
 int rdp_guac_client_mouse_handler(guac_client* client, int x, int y, int mask) {
 
     rdp_guac_client_data* guac_client_data = (rdp_guac_client_data*) client->data;
-    freerdp* rdp_inst = guac_client_data->rdp_inst;
 
-    pthread_mutex_lock(&(guac_client_data->rdp_lock));
+    /* All resulting events are queued together */
+    guac_rdp_input_batch batch;
+    guac_rdp_input_batch_init(&batch, &(guac_client_data->input_queue));
+
+    guac_rdp_flow_input_received(&(guac_client_data->flow));
 
     /* If button mask unchanged, just send move event */
     if (mask == guac_client_data->mouse_button_mask)
-        rdp_inst->input->MouseEvent(rdp_inst->input, PTR_FLAGS_MOVE, x, y);
+        guac_rdp_input_batch_add(&batch, GUAC_RDP_INPUT_EVENT_MOUSE,
+                PTR_FLAGS_MOVE, 0, x, y);
 
     /* Otherwise, send events describing button change */
     else {
@@ -246,7 +327,8 @@ int rdp_guac_client_mouse_handler(guac_client* client, int x, int y, int mask) {
             if (released_mask & 0x02) flags |= PTR_FLAGS_BUTTON3;
             if (released_mask & 0x04) flags |= PTR_FLAGS_BUTTON2;
 
-            rdp_inst->input->MouseEvent(rdp_inst->input, flags, x, y);
+            guac_rdp_input_batch_add(&batch, GUAC_RDP_INPUT_EVENT_MOUSE,
+                    flags, 0, x, y);
 
         }
 
@@ -262,7 +344,8 @@ int rdp_guac_client_mouse_handler(guac_client* client, int x, int y, int mask) {
             if (pressed_mask & 0x10) flags |= PTR_FLAGS_WHEEL | PTR_FLAGS_WHEEL_NEGATIVE | 0x88;
 
             /* Send event */
-            rdp_inst->input->MouseEvent(rdp_inst->input, flags, x, y);
+            guac_rdp_input_batch_add(&batch, GUAC_RDP_INPUT_EVENT_MOUSE,
+                    flags, 0, x, y);
 
         }
 
@@ -271,17 +354,15 @@ int rdp_guac_client_mouse_handler(guac_client* client, int x, int y, int mask) {
 
             /* Down */
             if (pressed_mask & 0x08)
-                rdp_inst->input->MouseEvent(
-                        rdp_inst->input,
+                guac_rdp_input_batch_add(&batch, GUAC_RDP_INPUT_EVENT_MOUSE,
                         PTR_FLAGS_WHEEL | 0x78,
-                        x, y);
+                        0, x, y);
 
             /* Up */
             if (pressed_mask & 0x10)
-                rdp_inst->input->MouseEvent(
-                        rdp_inst->input,
+                guac_rdp_input_batch_add(&batch, GUAC_RDP_INPUT_EVENT_MOUSE,
                         PTR_FLAGS_WHEEL | PTR_FLAGS_WHEEL_NEGATIVE | 0x88,
-                        x, y);
+                        0, x, y);
 
         }
 
@@ -289,16 +370,16 @@ int rdp_guac_client_mouse_handler(guac_client* client, int x, int y, int mask) {
         guac_client_data->mouse_button_mask = mask;
     }
 
-    pthread_mutex_unlock(&(guac_client_data->rdp_lock));
+    guac_rdp_input_batch_flush(&batch);
 
     return 0;
 }
 
 
-int __guac_rdp_send_keysym(guac_client* client, int keysym, int pressed) {
+int __guac_rdp_send_keysym(guac_client* client, guac_rdp_input_batch* batch,
+        int keysym, int pressed) {
 
     rdp_guac_client_data* guac_client_data = (rdp_guac_client_data*) client->data;
-    freerdp* rdp_inst = guac_client_data->rdp_inst;
 
     /* If keysym can be in lookup table */
     if (keysym <= 0xFFFF) {
@@ -310,32 +391,27 @@ int __guac_rdp_send_keysym(guac_client* client, int keysym, int pressed) {
         /* If defined, send event */
         if (keysym_desc->scancode != 0) {
 
-            pthread_mutex_lock(&(guac_client_data->rdp_lock));
-
             /* If defined, send any prerequesite keys that must be set */
             if (keysym_desc->set_keysyms != NULL)
-                __guac_rdp_update_keysyms(client, keysym_desc->set_keysyms, 0, 1);
+                __guac_rdp_update_keysyms(client, batch, keysym_desc->set_keysyms, 0, 1);
 
             /* If defined, release any keys that must be cleared */
             if (keysym_desc->clear_keysyms != NULL)
-                __guac_rdp_update_keysyms(client, keysym_desc->clear_keysyms, 1, 0);
+                __guac_rdp_update_keysyms(client, batch, keysym_desc->clear_keysyms, 1, 0);
 
             /* Send actual key */
-            rdp_inst->input->KeyboardEvent(
-                    rdp_inst->input,
+            guac_rdp_input_batch_add(batch, GUAC_RDP_INPUT_EVENT_KEYBOARD,
                     keysym_desc->flags
                         | (pressed ? KBD_FLAGS_DOWN : KBD_FLAGS_RELEASE),
-                    keysym_desc->scancode);
+                    keysym_desc->scancode, 0, 0);
 
             /* If defined, release any keys that were originally released */
             if (keysym_desc->set_keysyms != NULL)
-                __guac_rdp_update_keysyms(client, keysym_desc->set_keysyms, 0, 0);
+                __guac_rdp_update_keysyms(client, batch, keysym_desc->set_keysyms, 0, 0);
 
             /* If defined, send any keys that were originally set */
             if (keysym_desc->clear_keysyms != NULL)
-                __guac_rdp_update_keysyms(client, keysym_desc->clear_keysyms, 1, 1);
-
-            pthread_mutex_unlock(&(guac_client_data->rdp_lock));
+                __guac_rdp_update_keysyms(client, batch, keysym_desc->clear_keysyms, 1, 1);
 
             return 0;
 
@@ -364,14 +440,9 @@ int __guac_rdp_send_keysym(guac_client* client, int keysym, int pressed) {
         guac_client_log_info(client, "Translated keysym 0x%x to U+%04X",
                 keysym, codepoint);
 
-        pthread_mutex_lock(&(guac_client_data->rdp_lock));
-
         /* Send Unicode event */
-        rdp_inst->input->UnicodeKeyboardEvent(
-                rdp_inst->input,
-                0, codepoint);
-
-        pthread_mutex_unlock(&(guac_client_data->rdp_lock));
+        guac_rdp_input_batch_add(batch, GUAC_RDP_INPUT_EVENT_UNICODE,
+                0, codepoint, 0, 0);
 
     }
     
@@ -381,7 +452,8 @@ int __guac_rdp_send_keysym(guac_client* client, int keysym, int pressed) {
     return 0;
 }
 
-void __guac_rdp_update_keysyms(guac_client* client, const int* keysym_string, int from, int to) {
+void __guac_rdp_update_keysyms(guac_client* client, guac_rdp_input_batch* batch,
+        const int* keysym_string, int from, int to) {
 
     rdp_guac_client_data* guac_client_data = (rdp_guac_client_data*) client->data;
     int keysym;
@@ -394,7 +466,7 @@ void __guac_rdp_update_keysyms(guac_client* client, const int* keysym_string, in
 
         /* If key is currently in given state, send event for changing it to specified "to" state */
         if (current_state == from)
-            __guac_rdp_send_keysym(client, *keysym_string, to);
+            __guac_rdp_send_keysym(client, batch, *keysym_string, to);
 
         /* Next keysym */
         keysym_string++;
@@ -406,11 +478,20 @@ void __guac_rdp_update_keysyms(guac_client* client, const int* keysym_string, in
 int rdp_guac_client_key_handler(guac_client* client, int keysym, int pressed) {
 
     rdp_guac_client_data* guac_client_data = (rdp_guac_client_data*) client->data;
+    guac_rdp_input_batch batch;
+    int retval;
+
+    guac_rdp_flow_input_received(&(guac_client_data->flow));
 
     /* Update keysym state */
     GUAC_RDP_KEYSYM_LOOKUP(guac_client_data->keysym_state, keysym) = pressed;
 
-    return __guac_rdp_send_keysym(client, keysym, pressed);
+    /* Queue key and any modifier fix-ups together */
+    guac_rdp_input_batch_init(&batch, &(guac_client_data->input_queue));
+    retval = __guac_rdp_send_keysym(client, &batch, keysym, pressed);
+    guac_rdp_input_batch_flush(&batch);
+
+    return retval;
 
 }
 
@@ -0,0 +1,245 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cairo/cairo.h>
+
+#include <guacamole/socket.h>
+#include <guacamole/protocol.h>
+
+#include "guac_png.h"
+
+/**
+ * Initial size of any PNG buffer, in bytes. This is enough for typical
+ * cursor images without resizing.
+ */
+#define GUAC_RDP_PNG_BUFFER_INITIAL_SIZE 4096
+
+/**
+ * The amount of raw image data encoded within the first chunk sent by
+ * guac_rdp_send_png(), in bytes. The size of later chunks is adjusted based
+ * on how well earlier chunks compressed.
+ */
+#define GUAC_RDP_PNG_INITIAL_CHUNK_SIZE 0x10000
+
+/**
+ * The amount of encoded PNG data each chunk sent by guac_rdp_send_png()
+ * should contain, in bytes.
+ */
+#define GUAC_RDP_PNG_CHUNK_SIZE 0x8000
+
+/**
+ * The maximum amount of raw image data encoded within any one chunk sent by
+ * guac_rdp_send_png(), in bytes, regardless of how well that data
+ * compresses. This bounds the time spent encoding before data is sent.
+ */
+#define GUAC_RDP_PNG_MAX_CHUNK_SIZE 0x100000
+
+cairo_status_t __guac_rdp_png_write(void* closure,
+        const unsigned char* data, unsigned int length) {
+
+    guac_rdp_png_buffer* buffer = (guac_rdp_png_buffer*) closure;
+
+    /* Resize buffer if necessary */
+    if (buffer->length + length > buffer->size) {
+
+        /* Increase to double concatenated size to accomodate */
+        int size = (buffer->length + length)*2;
+        unsigned char* new_data = realloc(buffer->data, size);
+        if (new_data == NULL)
+            return CAIRO_STATUS_WRITE_ERROR;
+
+        buffer->data = new_data;
+        buffer->size = size;
+
+    }
+
+    /* Append to buffer */
+    memcpy(&(buffer->data[buffer->length]), data, length);
+    buffer->length += length;
+
+    return CAIRO_STATUS_SUCCESS;
+
+}
+
+int guac_rdp_png_encode(cairo_surface_t* surface,
+        guac_rdp_png_buffer* buffer) {
+
+    /* Allocate buffer if not yet allocated */
+    if (buffer->data == NULL) {
+
+        buffer->data = malloc(GUAC_RDP_PNG_BUFFER_INITIAL_SIZE);
+        if (buffer->data == NULL) {
+            buffer->length = 0;
+            return 1;
+        }
+
+        buffer->size = GUAC_RDP_PNG_BUFFER_INITIAL_SIZE;
+
+    }
+
+    /* Discard any existing data */
+    buffer->length = 0;
+
+    /* Encode surface */
+    if (cairo_surface_write_to_png_stream(surface, __guac_rdp_png_write,
+                buffer) != CAIRO_STATUS_SUCCESS) {
+        buffer->length = 0;
+        return 1;
+    }
+
+    return 0;
+
+}
+
+void guac_rdp_png_buffer_free(guac_rdp_png_buffer* buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->size = 0;
+}
+
+int __guac_rdp_write_length_int(guac_socket* socket, int value) {
+
+    char buffer[32];
+    int length = snprintf(buffer, sizeof(buffer), "%i", value);
+
+    return guac_socket_write_int(socket, length)
+        || guac_socket_write_string(socket, ".")
+        || guac_socket_write_string(socket, buffer);
+
+}
+
+int guac_rdp_send_png_buffer(guac_socket* socket, guac_composite_mode mode,
+        const guac_layer* layer, int x, int y,
+        const guac_rdp_png_buffer* buffer) {
+
+    /* Length of base64-encoded PNG data */
+    int base64_length = (buffer->length + 2) / 3 * 4;
+
+    return
+           guac_socket_write_string(socket, "3.png,")
+        || __guac_rdp_write_length_int(socket, mode)
+        || guac_socket_write_string(socket, ",")
+        || __guac_rdp_write_length_int(socket, layer->index)
+        || guac_socket_write_string(socket, ",")
+        || __guac_rdp_write_length_int(socket, x)
+        || guac_socket_write_string(socket, ",")
+        || __guac_rdp_write_length_int(socket, y)
+        || guac_socket_write_string(socket, ",")
+        || guac_socket_write_int(socket, base64_length)
+        || guac_socket_write_string(socket, ".")
+        || guac_socket_write_base64(socket, buffer->data, buffer->length)
+        || guac_socket_flush_base64(socket)
+        || guac_socket_write_string(socket, ";");
+
+}
+
+int guac_rdp_send_png(guac_socket* socket, guac_composite_mode mode,
+        const guac_layer* layer, int x, int y, cairo_surface_t* surface) {
+
+    guac_rdp_png_buffer buffer = { NULL, 0, 0 };
+
+    unsigned char* data;
+    cairo_format_t format;
+    int width, height, stride;
+    int max_rows;
+    int rows;
+    int row;
+    int result = 0;
+
+    /* Ensure all drawing to the surface is complete */
+    cairo_surface_flush(surface);
+
+    data   = cairo_image_surface_get_data(surface);
+    format = cairo_image_surface_get_format(surface);
+    width  = cairo_image_surface_get_width(surface);
+    height = cairo_image_surface_get_height(surface);
+    stride = cairo_image_surface_get_stride(surface);
+
+    /* Begin with chunks of a fixed amount of raw data */
+    max_rows = GUAC_RDP_PNG_MAX_CHUNK_SIZE / stride;
+    if (max_rows < 1)
+        max_rows = 1;
+
+    rows = GUAC_RDP_PNG_INITIAL_CHUNK_SIZE / stride;
+    if (rows < 1)
+        rows = 1;
+
+    /* Send each chunk of rows as soon as it is encoded */
+    row = 0;
+    while (row < height && !result) {
+
+        cairo_surface_t* chunk;
+
+        /* Last chunk may be shorter */
+        int chunk_rows = rows;
+        if (chunk_rows > height - row)
+            chunk_rows = height - row;
+
+        chunk = cairo_image_surface_create_for_data(data + row*stride,
+                format, width, chunk_rows, stride);
+
+        result = guac_rdp_png_encode(chunk, &buffer)
+              || guac_rdp_send_png_buffer(socket, mode, layer,
+                      x, y + row, &buffer);
+
+        cairo_surface_destroy(chunk);
+        row += chunk_rows;
+
+        /* Size next chunk such that its encoded size is roughly the
+         * target, based on the compression of this chunk */
+        if (buffer.length > 0)
+            rows = (int) ((int64_t) GUAC_RDP_PNG_CHUNK_SIZE * chunk_rows
+                    / buffer.length);
+
+        if (rows < 1)
+            rows = 1;
+        else if (rows > max_rows)
+            rows = max_rows;
+
+    }
+
+    guac_rdp_png_buffer_free(&buffer);
+    return result;
+
+}
+
@@ -0,0 +1,295 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <freerdp/freerdp.h>
+#include <freerdp/input.h>
+
+#include "input_queue.h"
+
+int guac_rdp_input_queue_init(guac_rdp_input_queue* queue, int mouse_rate) {
+
+    uint32_t i;
+
+    /* Each slot is initially free for the producer at its own position */
+    for (i=0; i<GUAC_RDP_INPUT_QUEUE_SIZE; i++)
+        queue->slots[i].sequence = i;
+
+    queue->head = 0;
+    queue->tail = 0;
+
+    /* No motion sent yet */
+    queue->motion_interval = mouse_rate > 0 ? 1000 / mouse_rate : 0;
+    queue->motion_pending = 0;
+    queue->motion_sent = 0;
+
+    queue->event_fd = eventfd(0, EFD_NONBLOCK);
+    return queue->event_fd == -1;
+
+}
+
+void guac_rdp_input_queue_destroy(guac_rdp_input_queue* queue) {
+    close(queue->event_fd);
+}
+
+/**
+ * Attempts to add the given events to the given queue as a contiguous block,
+ * returning non-zero if the queue does not have enough free space.
+ */
+int __guac_rdp_input_queue_offer(guac_rdp_input_queue* queue,
+        const guac_rdp_input_event* events, int count) {
+
+    uint32_t position = queue->head;
+
+    for (;;) {
+
+        /* Slots are freed in order, so if the last slot of the block is
+         * free, all others are free as well */
+        uint32_t last = position + count - 1;
+        guac_rdp_input_queue_slot* slot =
+            &(queue->slots[last & (GUAC_RDP_INPUT_QUEUE_SIZE - 1)]);
+
+        int32_t diff = (int32_t) (slot->sequence - last);
+
+        /* Slots are free - attempt to claim them */
+        if (diff == 0) {
+
+            if (__sync_bool_compare_and_swap(&(queue->head),
+                        position, position + count)) {
+
+                int i;
+                for (i=0; i<count; i++) {
+
+                    slot = &(queue->slots[(position + i)
+                            & (GUAC_RDP_INPUT_QUEUE_SIZE - 1)]);
+
+                    slot->event = events[i];
+
+                    /* Publish event only after it is fully written */
+                    __sync_synchronize();
+                    slot->sequence = position + i + 1;
+
+                }
+
+                return 0;
+
+            }
+
+        }
+
+        /* Queue is full */
+        else if (diff < 0)
+            return 1;
+
+        /* Another producer claimed this position - retry at new head */
+        position = queue->head;
+
+    }
+
+}
+
+void guac_rdp_input_queue_push(guac_rdp_input_queue* queue,
+        const guac_rdp_input_event* events, int count) {
+
+    if (count <= 0)
+        return;
+
+    /* Wait for consumer to free space if full */
+    while (__guac_rdp_input_queue_offer(queue, events, count))
+        sched_yield();
+
+    /* Wake consumer */
+    eventfd_write(queue->event_fd, 1);
+
+}
+
+void guac_rdp_input_batch_init(guac_rdp_input_batch* batch,
+        guac_rdp_input_queue* queue) {
+    batch->queue = queue;
+    batch->count = 0;
+}
+
+void guac_rdp_input_batch_add(guac_rdp_input_batch* batch,
+        guac_rdp_input_event_type type, int flags, int code, int x, int y) {
+
+    guac_rdp_input_event* event;
+
+    /* Make room if batch is full */
+    if (batch->count == GUAC_RDP_INPUT_BATCH_SIZE)
+        guac_rdp_input_batch_flush(batch);
+
+    event = &(batch->events[batch->count++]);
+    event->type  = type;
+    event->flags = flags;
+    event->code  = code;
+    event->x     = x;
+    event->y     = y;
+
+}
+
+void guac_rdp_input_batch_flush(guac_rdp_input_batch* batch) {
+    guac_rdp_input_queue_push(batch->queue, batch->events, batch->count);
+    batch->count = 0;
+}
+
+/**
+ * Sets or clears TCP_CORK on the given socket. While corked, partial
+ * segments are held back, such that several small PDUs share one segment.
+ */
+void __guac_rdp_input_queue_cork(int fd, int corked) {
+    if (fd != -1)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &corked, sizeof(corked));
+}
+
+/**
+ * Sends the given event using the given FreeRDP input interface.
+ */
+void __guac_rdp_input_queue_send(rdpInput* input,
+        const guac_rdp_input_event* event) {
+
+    switch (event->type) {
+
+        case GUAC_RDP_INPUT_EVENT_MOUSE:
+            input->MouseEvent(input, event->flags, event->x, event->y);
+            break;
+
+        case GUAC_RDP_INPUT_EVENT_KEYBOARD:
+            input->KeyboardEvent(input, event->flags, event->code);
+            break;
+
+        case GUAC_RDP_INPUT_EVENT_UNICODE:
+            input->UnicodeKeyboardEvent(input, event->flags, event->code);
+            break;
+
+    }
+
+}
+
+/**
+ * Sends any pending mouse motion, regardless of the motion rate.
+ */
+void __guac_rdp_input_queue_flush_motion(guac_rdp_input_queue* queue,
+        rdpInput* input) {
+
+    if (queue->motion_pending) {
+        __guac_rdp_input_queue_send(input, &(queue->motion));
+        queue->motion_pending = 0;
+        queue->motion_sent = guac_protocol_get_timestamp();
+    }
+
+}
+
+int guac_rdp_input_queue_drain(guac_rdp_input_queue* queue,
+        freerdp* rdp_inst, int rdp_fd) {
+
+    rdpInput* input = rdp_inst->input;
+    eventfd_t value;
+    int elapsed;
+    int corked = 0;
+
+    /* Acknowledge wakeup before draining, such that no event is missed */
+    eventfd_read(queue->event_fd, &value);
+
+    for (;;) {
+
+        guac_rdp_input_queue_slot* slot =
+            &(queue->slots[queue->tail & (GUAC_RDP_INPUT_QUEUE_SIZE - 1)]);
+
+        guac_rdp_input_event event;
+
+        /* Stop if no further events are ready */
+        if (slot->sequence != queue->tail + 1)
+            break;
+
+        /* Hold back PDUs until all ready events are sent */
+        if (!corked) {
+            __guac_rdp_input_queue_cork(rdp_fd, 1);
+            corked = 1;
+        }
+
+        /* Read event only after its sequence number */
+        __sync_synchronize();
+        event = slot->event;
+
+        /* Release slot for reuse once event is read */
+        __sync_synchronize();
+        slot->sequence = queue->tail + GUAC_RDP_INPUT_QUEUE_SIZE;
+        queue->tail++;
+
+        /* Coalesce motion, keeping only the latest position */
+        if (event.type == GUAC_RDP_INPUT_EVENT_MOUSE
+                && event.flags == PTR_FLAGS_MOVE) {
+            queue->motion = event;
+            queue->motion_pending = 1;
+            continue;
+        }
+
+        /* Preserve ordering of motion relative to all other events */
+        __guac_rdp_input_queue_flush_motion(queue, input);
+        __guac_rdp_input_queue_send(input, &event);
+
+    }
+
+    /* Send motion if allowed by rate */
+    if (queue->motion_pending) {
+        elapsed = guac_protocol_get_timestamp() - queue->motion_sent;
+        if (elapsed >= queue->motion_interval || elapsed < 0)
+            __guac_rdp_input_queue_flush_motion(queue, input);
+    }
+
+    /* Transmit all PDUs together */
+    if (corked)
+        __guac_rdp_input_queue_cork(rdp_fd, 0);
+
+    /* Nothing further to do if no motion remains */
+    if (!queue->motion_pending)
+        return -1;
+
+    /* Otherwise, wait for remaining time */
+    return queue->motion_interval - elapsed;
+
+}
+
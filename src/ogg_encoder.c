@@ -35,66 +35,289 @@
  *
  * ***** END LICENSE BLOCK ***** */
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <guacamole/client.h>
 #include <guacamole/protocol.h>
 
 #include <vorbis/vorbisenc.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "audio.h"
 #include "ogg_encoder.h"
 
-void ogg_encoder_begin_handler(audio_stream* audio) {
+/**
+ * Writes all Ogg pages of the given encoder state to the given audio stream,
+ * including any partial page if flush is non-zero.
+ */
+void __ogg_encoder_write_pages(audio_stream* audio, ogg_encoder_state* state,
+        int flush) {
+
+    while ((flush
+                ? ogg_stream_flush(&(state->ogg_state), &(state->ogg_page))
+                : ogg_stream_pageout(&(state->ogg_state), &(state->ogg_page)))
+            != 0) {
+
+        /* Write packet header */
+        audio_stream_write_encoded(audio,
+                state->ogg_page.header,
+                state->ogg_page.header_len);
+
+        /* Write packet body */
+        audio_stream_write_encoded(audio,
+                state->ogg_page.body,
+                state->ogg_page.body_len);
+
+    }
+
+}
+
+/**
+ * Converts unsigned 8-bit PCM with any number of channels.
+ */
+void __ogg_encoder_convert_u8(float** buffer,
+        const unsigned char* pcm_data, int frames, int channels) {
+
+    int i, channel;
+
+    for (i=0; i<frames; i++) {
+        for (channel=0; channel<channels; channel++)
+            buffer[channel][i] = ((int) *(pcm_data++) - 128) / 128.f;
+    }
+
+}
+
+/**
+ * Converts signed 16-bit little-endian PCM with any number of channels.
+ */
+void __ogg_encoder_convert_s16(float** buffer,
+        const unsigned char* pcm_data, int frames, int channels) {
+
+    int i, channel;
+
+    for (i=0; i<frames; i++) {
+        for (channel=0; channel<channels; channel++) {
+
+            int16_t value = (int16_t) (pcm_data[0] | (pcm_data[1] << 8));
+            buffer[channel][i] = value / 32768.f;
+
+            pcm_data += 2;
+
+        }
+    }
+
+}
+
+#ifdef __SSE2__
+/**
+ * Converts signed 16-bit little-endian mono PCM, eight samples at a time.
+ */
+void __ogg_encoder_convert_s16_mono_sse2(float** buffer,
+        const unsigned char* pcm_data, int frames, int channels) {
+
+    const __m128 scale = _mm_set1_ps(1 / 32768.f);
+    int i;
+
+    for (i=0; i+8<=frames; i+=8) {
+
+        __m128i samples = _mm_loadu_si128((const __m128i*) pcm_data);
+
+        /* Sign-extend to 32-bit */
+        __m128i low  = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+
+        _mm_storeu_ps(buffer[0] + i,
+                _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+        _mm_storeu_ps(buffer[0] + i + 4,
+                _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+
+        pcm_data += 16;
+
+    }
+
+    /* Convert remaining samples */
+    if (i < frames) {
+        float* remaining[1] = { buffer[0] + i };
+        __ogg_encoder_convert_s16(remaining, pcm_data, frames - i, 1);
+    }
+
+}
+
+/**
+ * Converts signed 16-bit little-endian stereo PCM, four frames at a time.
+ */
+void __ogg_encoder_convert_s16_stereo_sse2(float** buffer,
+        const unsigned char* pcm_data, int frames, int channels) {
+
+    const __m128 scale = _mm_set1_ps(1 / 32768.f);
+    int i;
+
+    for (i=0; i+4<=frames; i+=4) {
+
+        __m128i samples = _mm_loadu_si128((const __m128i*) pcm_data);
+
+        /* Sign-extend to 32-bit: L0 R0 L1 R1 and L2 R2 L3 R3 */
+        __m128 low  = _mm_cvtepi32_ps(
+                _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16));
+        __m128 high = _mm_cvtepi32_ps(
+                _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16));
+
+        /* Deinterleave into L0 L1 L2 L3 and R0 R1 R2 R3 */
+        _mm_storeu_ps(buffer[0] + i, _mm_mul_ps(
+                    _mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0)), scale));
+        _mm_storeu_ps(buffer[1] + i, _mm_mul_ps(
+                    _mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1)), scale));
+
+        pcm_data += 16;
+
+    }
+
+    /* Convert remaining frames */
+    if (i < frames) {
+        float* remaining[2] = { buffer[0] + i, buffer[1] + i };
+        __ogg_encoder_convert_s16(remaining, pcm_data, frames - i, 2);
+    }
+
+}
+#endif
+
+/**
+ * Returns the converter appropriate for PCM data having the given number of
+ * channels and bits per sample.
+ */
+ogg_encoder_convert_handler* __ogg_encoder_select_converter(int channels,
+        int bps) {
+
+    /* 8-bit PCM is unsigned */
+    if (bps == 8)
+        return __ogg_encoder_convert_u8;
+
+#ifdef __SSE2__
+    if (channels == 1)
+        return __ogg_encoder_convert_s16_mono_sse2;
+
+    if (channels == 2)
+        return __ogg_encoder_convert_s16_stereo_sse2;
+#endif
+
+    return __ogg_encoder_convert_s16;
+
+}
+
+/**
+ * Allocates and initializes new encoder settings for the current format and
+ * quality of the given audio stream.
+ */
+ogg_encoder_state* __ogg_encoder_state_alloc(audio_stream* audio) {
 
     /* Allocate stream state */
     ogg_encoder_state* state = (ogg_encoder_state*)
         malloc(sizeof(ogg_encoder_state));
 
-    /* Init state */
-    vorbis_info_init(&(state->info));
-    vorbis_encode_init_vbr(&(state->info), audio->channels, audio->rate, 0.4);
+    /* Store format */
+    state->rate = audio->rate;
+    state->channels = audio->channels;
+    state->bps = audio->bps;
+    state->quality = audio->quality;
 
-    vorbis_analysis_init(&(state->vorbis_state), &(state->info));
-    vorbis_block_init(&(state->vorbis_state), &(state->vorbis_block));
+    /* Choose PCM converter once for this format */
+    state->convert = __ogg_encoder_select_converter(audio->channels,
+            audio->bps);
+
+    /* Init settings */
+    vorbis_info_init(&(state->info));
+    vorbis_encode_init_vbr(&(state->info), audio->channels, audio->rate,
+            audio->quality);
 
     vorbis_comment_init(&(state->comment));
     vorbis_comment_add_tag(&(state->comment), "ENCODER", "libguac-client-rdp");
 
     ogg_stream_init(&(state->ogg_state), rand());
+    state->stream_open = 0;
 
-    /* Write headers */
-    {
-        ogg_packet header;
-        ogg_packet header_comm;
-        ogg_packet header_code;
-
-        vorbis_analysis_headerout(
-                &(state->vorbis_state),
-                &(state->comment),
-                &header, &header_comm, &header_code);
-
-        ogg_stream_packetin(&(state->ogg_state), &header);
-        ogg_stream_packetin(&(state->ogg_state), &header_comm);
-        ogg_stream_packetin(&(state->ogg_state), &header_code);
-
-        /* For each packet */
-        while (ogg_stream_flush(&(state->ogg_state), &(state->ogg_page)) != 0) {
-
-            /* Write packet header */
-            audio_stream_write_encoded(audio,
-                    state->ogg_page.header,
-                    state->ogg_page.header_len);
-
-            /* Write packet body */
-            audio_stream_write_encoded(audio,
-                    state->ogg_page.body,
-                    state->ogg_page.body_len);
-        }
+    return state;
+
+}
+
+/**
+ * Ends the logical stream of the current audio chunk, if any, freeing its
+ * Vorbis analysis state.
+ */
+void __ogg_encoder_stream_close(ogg_encoder_state* state) {
+
+    if (!state->stream_open)
+        return;
+
+    vorbis_block_clear(&(state->vorbis_block));
+    vorbis_dsp_clear(&(state->vorbis_state));
+    state->stream_open = 0;
+
+}
+
+/**
+ * Frees the given encoder state and all resources associated with it.
+ */
+void __ogg_encoder_state_free(ogg_encoder_state* state) {
+
+    /* Clean up encoder */
+    __ogg_encoder_stream_close(state);
+    ogg_stream_clear(&(state->ogg_state));
+    vorbis_comment_clear(&(state->comment));
+    vorbis_info_clear(&(state->info));
+
+    /* Free stream state */
+    free(state);
+
+}
+
+void ogg_encoder_begin_handler(audio_stream* audio) {
+
+    ogg_encoder_state* state = (ogg_encoder_state*) audio->data;
+
+    ogg_packet header;
+    ogg_packet header_comm;
+    ogg_packet header_code;
+
+    /* Replace settings only if format or quality has changed */
+    if (state == NULL
+            || state->rate != audio->rate
+            || state->channels != audio->channels
+            || state->bps != audio->bps
+            || state->quality != audio->quality) {
+
+        if (state != NULL)
+            __ogg_encoder_state_free(state);
+
+        state = __ogg_encoder_state_alloc(audio);
+        audio->data = state;
 
     }
 
-    audio->data = state;
+    /* Each chunk is decoded on its own, and so must be a complete logical
+     * stream, with granule positions and page numbers starting from zero */
+    __ogg_encoder_stream_close(state);
+    ogg_stream_reset(&(state->ogg_state));
+
+    vorbis_analysis_init(&(state->vorbis_state), &(state->info));
+    vorbis_block_init(&(state->vorbis_state), &(state->vorbis_block));
+    state->stream_open = 1;
+
+    /* Write headers, each on their own pages */
+    vorbis_analysis_headerout(
+            &(state->vorbis_state),
+            &(state->comment),
+            &header, &header_comm, &header_code);
+
+    ogg_stream_packetin(&(state->ogg_state), &header);
+    ogg_stream_packetin(&(state->ogg_state), &header_comm);
+    ogg_stream_packetin(&(state->ogg_state), &header_code);
+
+    __ogg_encoder_write_pages(audio, state, 1);
 
 }
 
@@ -118,23 +341,7 @@ void ogg_encoder_write_blocks(audio_stream* audio) {
             ogg_stream_packetin(&(state->ogg_state), &(state->ogg_packet));
 
             /* Write out pages */
-            while (ogg_stream_pageout(&(state->ogg_state),
-                        &(state->ogg_page)) != 0) {
-
-                /* Write packet header */
-                audio_stream_write_encoded(audio,
-                        state->ogg_page.header,
-                        state->ogg_page.header_len);
-
-                /* Write packet body */
-                audio_stream_write_encoded(audio,
-                        state->ogg_page.body,
-                        state->ogg_page.body_len);
-
-                if (ogg_page_eos(&(state->ogg_page)))
-                    break;
-
-            }
+            __ogg_encoder_write_pages(audio, state, 0);
 
         }
 
@@ -147,19 +354,24 @@ void ogg_encoder_end_handler(audio_stream* audio) {
     /* Get state */
     ogg_encoder_state* state = (ogg_encoder_state*) audio->data;
 
-    /* Write end-of-stream */
+    /* Mark end of data, encoding all remaining samples. The final packet
+     * ends the logical stream, and its granule position allows the decoder
+     * to trim padding such that the chunk has exactly the duration sent. */
     vorbis_analysis_wrote(&(state->vorbis_state), 0);
     ogg_encoder_write_blocks(audio);
 
-    /* Clean up encoder */
-    ogg_stream_clear(&(state->ogg_state));
-    vorbis_block_clear(&(state->vorbis_block));
-    vorbis_dsp_clear(&(state->vorbis_state));
-    vorbis_comment_clear(&(state->comment));
-    vorbis_info_clear(&(state->info));
+    /* Write any remaining partial page */
+    __ogg_encoder_write_pages(audio, state, 1);
 
-    /* Free stream state */
-    free(audio->data);
+    __ogg_encoder_stream_close(state);
+
+}
+
+void ogg_encoder_free_handler(audio_stream* audio) {
+
+    /* Free encoder, if ever used */
+    if (audio->data != NULL)
+        __ogg_encoder_state_free((ogg_encoder_state*) audio->data);
 
 }
 
@@ -170,25 +382,13 @@ void ogg_encoder_write_handler(audio_stream* audio,
     ogg_encoder_state* state = (ogg_encoder_state*) audio->data;
 
     /* Calculate samples */
-    int samples = length / audio->channels * 8 / audio->bps;
-    int i;
+    int samples = length / (audio->channels * audio->bps / 8);
 
     /* Get buffer */
     float** buffer = vorbis_analysis_buffer(&(state->vorbis_state), samples);
 
-    signed char* readbuffer = (signed char*) pcm_data;
-
-    for (i=0; i<samples; i++) {
-
-        /* FIXME: For now, assume 2 channels, 16-bit */
-        int left  = ((readbuffer[i*4+1]<<8)|(0x00ff&(int)readbuffer[i*4]));
-        int right = ((readbuffer[i*4+3]<<8)|(0x00ff&(int)readbuffer[i*4+2]));
-
-        /* Store sample in buffer */
-        buffer[0][i] = left  / 32768.f;
-        buffer[1][i] = right / 32768.f;
-
-    }
+    /* Convert to float */
+    state->convert(buffer, pcm_data, samples, audio->channels);
 
     /* Submit data */
     vorbis_analysis_wrote(&(state->vorbis_state), samples);
@@ -203,7 +403,8 @@ audio_encoder _ogg_encoder = {
     .mimetype      = "audio/ogg",
     .begin_handler = ogg_encoder_begin_handler,
     .write_handler = ogg_encoder_write_handler,
-    .end_handler   = ogg_encoder_end_handler
+    .end_handler   = ogg_encoder_end_handler,
+    .free_handler  = ogg_encoder_free_handler
 };
 
 /* Actual encoder */
@@ -0,0 +1,441 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <guacamole/client.h>
+#include <guacamole/protocol.h>
+
+#include <ogg/ogg.h>
+#include <opus/opus.h>
+
+#include "audio.h"
+#include "audio_resampler.h"
+#include "opus_encoder.h"
+
+/**
+ * The sample rate of all Ogg Opus granule positions, and the rate used for
+ * PCM which Opus cannot encode directly.
+ */
+#define OPUS_ENCODER_GRANULE_RATE 48000
+
+/**
+ * Writes the given value in little-endian byte order.
+ */
+void __opus_encoder_write_le16(unsigned char* buffer, int value) {
+    buffer[0] =  value       & 0xFF;
+    buffer[1] = (value >> 8) & 0xFF;
+}
+
+/**
+ * Writes the given value in little-endian byte order.
+ */
+void __opus_encoder_write_le32(unsigned char* buffer, uint32_t value) {
+    __opus_encoder_write_le16(buffer,      value        & 0xFFFF);
+    __opus_encoder_write_le16(buffer + 2, (value >> 16) & 0xFFFF);
+}
+
+/**
+ * Returns whether Opus can encode at the given sample rate.
+ */
+int __opus_encoder_rate_supported(int rate) {
+    return rate ==  8000 || rate == 12000 || rate == 16000
+        || rate == 24000 || rate == 48000;
+}
+
+/**
+ * Returns the Opus bitrate corresponding to the given relative quality.
+ */
+opus_int32 __opus_encoder_bitrate(double quality) {
+    return OPUS_ENCODER_MIN_BITRATE
+        + (opus_int32) (quality
+                * (OPUS_ENCODER_MAX_BITRATE - OPUS_ENCODER_MIN_BITRATE));
+}
+
+/**
+ * Writes all Ogg pages of the given encoder state to the given audio stream,
+ * including any partial page if flush is non-zero.
+ */
+void __opus_encoder_write_pages(audio_stream* audio,
+        opus_encoder_state* state, int flush) {
+
+    while ((flush
+                ? ogg_stream_flush(&(state->ogg_state), &(state->ogg_page))
+                : ogg_stream_pageout(&(state->ogg_state), &(state->ogg_page)))
+            != 0) {
+
+        /* Write packet header */
+        audio_stream_write_encoded(audio,
+                state->ogg_page.header,
+                state->ogg_page.header_len);
+
+        /* Write packet body */
+        audio_stream_write_encoded(audio,
+                state->ogg_page.body,
+                state->ogg_page.body_len);
+
+    }
+
+}
+
+/**
+ * Adds the given header packet to the Ogg stream of the given encoder state,
+ * writing the resulting page to the given audio stream. Each header packet
+ * must be on its own page.
+ */
+void __opus_encoder_write_header(audio_stream* audio,
+        opus_encoder_state* state, unsigned char* data, int length) {
+
+    ogg_packet packet;
+
+    packet.packet = data;
+    packet.bytes = length;
+    packet.b_o_s = (state->packetno == 0);
+    packet.e_o_s = 0;
+    packet.granulepos = 0;
+    packet.packetno = state->packetno++;
+
+    ogg_stream_packetin(&(state->ogg_state), &packet);
+    __opus_encoder_write_pages(audio, state, 1);
+
+}
+
+/**
+ * Allocates and initializes a new encoder for the current format and
+ * quality of the given audio stream, generating its header pages.
+ */
+opus_encoder_state* __opus_encoder_state_alloc(audio_stream* audio) {
+
+    unsigned char* head;
+    unsigned char* tags;
+
+    opus_int32 lookahead = 0;
+    int error;
+
+    /* Allocate stream state */
+    opus_encoder_state* state = (opus_encoder_state*)
+        malloc(sizeof(opus_encoder_state));
+
+    /* Store format */
+    state->rate = audio->rate;
+    state->channels = audio->channels;
+    state->bps = audio->bps;
+    state->quality = audio->quality;
+
+    /* Encode as-is if possible, converting otherwise */
+    if (__opus_encoder_rate_supported(audio->rate) && audio->bps == 16
+            && audio->channels <= 2) {
+        state->encoder_rate = audio->rate;
+        state->encoder_channels = audio->channels;
+        state->resampler = NULL;
+    }
+    else {
+        state->encoder_rate = OPUS_ENCODER_GRANULE_RATE;
+        state->encoder_channels = audio->channels > 2 ? 2 : audio->channels;
+        state->resampler = audio_resampler_alloc();
+        audio_resampler_set_format(state->resampler,
+                audio->rate, audio->channels, audio->bps,
+                state->encoder_rate, state->encoder_channels);
+    }
+
+    /* Init frame */
+    state->frame_size = state->encoder_rate
+                      * OPUS_ENCODER_FRAME_DURATION / 1000;
+    state->frame_used = 0;
+    state->frame = malloc(state->frame_size * state->encoder_channels
+            * sizeof(opus_int16));
+
+    state->samples = 0;
+    state->encoded = 0;
+    state->packetno = 0;
+
+    /* Init encoder */
+    state->encoder = opus_encoder_create(state->encoder_rate,
+            state->encoder_channels, OPUS_APPLICATION_RESTRICTED_LOWDELAY,
+            &error);
+
+    if (error != OPUS_OK)
+        guac_client_log_error(audio->client,
+                "Unable to create Opus encoder: error %i", error);
+
+    else {
+        opus_encoder_ctl(state->encoder,
+                OPUS_SET_BITRATE(__opus_encoder_bitrate(audio->quality)));
+        opus_encoder_ctl(state->encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+    }
+
+    state->pre_skip = lookahead;
+
+    ogg_stream_init(&(state->ogg_state), rand());
+
+    /* Identification header */
+    head = state->head;
+    memcpy(head, "OpusHead", 8);
+    head[8] = 1; /* Version */
+    head[9] = state->encoder_channels;
+    __opus_encoder_write_le16(head + 10, lookahead
+            * (OPUS_ENCODER_GRANULE_RATE / state->encoder_rate));
+    __opus_encoder_write_le32(head + 12, audio->rate);
+    __opus_encoder_write_le16(head + 16, 0); /* Output gain */
+    head[18] = 0; /* Channel mapping family */
+
+    /* Comment header, containing only the vendor string */
+    tags = state->tags;
+    memcpy(tags, "OpusTags", 8);
+    __opus_encoder_write_le32(tags + 8, OPUS_ENCODER_VENDOR_LENGTH);
+    memcpy(tags + 12, OPUS_ENCODER_VENDOR, OPUS_ENCODER_VENDOR_LENGTH);
+    __opus_encoder_write_le32(tags + 12 + OPUS_ENCODER_VENDOR_LENGTH, 0);
+
+    return state;
+
+}
+
+/**
+ * Frees the given encoder state and all resources associated with it.
+ */
+void __opus_encoder_state_free(opus_encoder_state* state) {
+
+    /* Clean up encoder */
+    if (state->encoder != NULL)
+        opus_encoder_destroy(state->encoder);
+
+    ogg_stream_clear(&(state->ogg_state));
+
+    if (state->resampler != NULL)
+        audio_resampler_free(state->resampler);
+
+    /* Free stream state */
+    free(state->frame);
+    free(state);
+
+}
+
+/**
+ * Encodes the completed frame of the given encoder state as a single Opus
+ * packet, adding that packet to the Ogg stream. If last is non-zero, the
+ * packet ends the logical stream, and its granule position marks the end of
+ * the PCM data received, such that the decoder discards any padding.
+ */
+void __opus_encoder_encode_frame(audio_stream* audio,
+        opus_encoder_state* state, int last) {
+
+    unsigned char data[OPUS_ENCODER_MAX_PACKET];
+    ogg_packet packet;
+
+    /* Granule positions are always in 48 kHz samples */
+    int scale = OPUS_ENCODER_GRANULE_RATE / state->encoder_rate;
+
+    int length = opus_encode(state->encoder, state->frame, state->frame_size,
+            data, sizeof(data));
+
+    state->frame_used = 0;
+    state->encoded += state->frame_size;
+
+    if (length < 0) {
+        guac_client_log_error(audio->client,
+                "Opus encoding failed: error %i", length);
+        return;
+    }
+
+    packet.packet = data;
+    packet.bytes = length;
+    packet.b_o_s = 0;
+    packet.e_o_s = last;
+    packet.packetno = state->packetno++;
+
+    if (last)
+        packet.granulepos = (ogg_int64_t) (state->pre_skip + state->samples)
+                          * scale;
+    else
+        packet.granulepos = (ogg_int64_t) state->encoded * scale;
+
+    ogg_stream_packetin(&(state->ogg_state), &packet);
+    __opus_encoder_write_pages(audio, state, 0);
+
+}
+
+void opus_encoder_begin_handler(audio_stream* audio) {
+
+    opus_encoder_state* state = (opus_encoder_state*) audio->data;
+
+    /* Replace encoder only if format has changed */
+    if (state == NULL
+            || state->rate != audio->rate
+            || state->channels != audio->channels
+            || state->bps != audio->bps) {
+
+        if (state != NULL)
+            __opus_encoder_state_free(state);
+
+        state = __opus_encoder_state_alloc(audio);
+        audio->data = state;
+
+    }
+
+    /* Opus bitrate can change between frames without a new stream */
+    else if (state->quality != audio->quality && state->encoder != NULL) {
+        opus_encoder_ctl(state->encoder,
+                OPUS_SET_BITRATE(__opus_encoder_bitrate(audio->quality)));
+        state->quality = audio->quality;
+    }
+
+    if (state->encoder == NULL)
+        return;
+
+    /* Each chunk is decoded on its own, and so must be a complete logical
+     * stream, with granule positions and page numbers starting from zero */
+    opus_encoder_ctl(state->encoder, OPUS_RESET_STATE);
+    ogg_stream_reset(&(state->ogg_state));
+
+    state->frame_used = 0;
+    state->samples = 0;
+    state->encoded = 0;
+    state->packetno = 0;
+
+    __opus_encoder_write_header(audio, state,
+            state->head, OPUS_ENCODER_HEAD_LENGTH);
+
+    __opus_encoder_write_header(audio, state,
+            state->tags, OPUS_ENCODER_TAGS_LENGTH);
+
+}
+
+void opus_encoder_write_handler(audio_stream* audio,
+        unsigned char* pcm_data, int length) {
+
+    /* Get state */
+    opus_encoder_state* state = (opus_encoder_state*) audio->data;
+
+    int channels = state->encoder_channels;
+    int samples;
+
+    if (state->encoder == NULL)
+        return;
+
+    /* Convert data first if necessary */
+    if (state->resampler != NULL)
+        length = audio_resampler_convert(state->resampler, pcm_data, length,
+                &pcm_data);
+
+    samples = length / 2;
+
+    /* Fill frames, encoding each as it is completed */
+    while (samples > 0) {
+
+        opus_int16* current = state->frame + state->frame_used * channels;
+
+        int count = (state->frame_size - state->frame_used) * channels;
+        int i;
+
+        if (count > samples)
+            count = samples - samples % channels;
+
+        if (count == 0)
+            break;
+
+        /* Copy little-endian samples */
+        for (i=0; i<count; i++) {
+            *(current++) = (opus_int16) (pcm_data[0] | (pcm_data[1] << 8));
+            pcm_data += 2;
+        }
+
+        samples -= count;
+        state->frame_used += count / channels;
+        state->samples += count / channels;
+
+        if (state->frame_used == state->frame_size)
+            __opus_encoder_encode_frame(audio, state, 0);
+
+    }
+
+}
+
+void opus_encoder_end_handler(audio_stream* audio) {
+
+    /* Get state */
+    opus_encoder_state* state = (opus_encoder_state*) audio->data;
+
+    int channels;
+
+    if (state->encoder == NULL)
+        return;
+
+    channels = state->encoder_channels;
+
+    /* Pad with silence until all received samples have passed through the
+     * encoder delay, ending the stream with the final frame */
+    do {
+
+        memset(state->frame + state->frame_used * channels, 0,
+                (state->frame_size - state->frame_used) * channels
+                    * sizeof(opus_int16));
+
+        state->frame_used = state->frame_size;
+
+        __opus_encoder_encode_frame(audio, state,
+                state->encoded + state->frame_size
+                    >= state->pre_skip + state->samples);
+
+    } while (state->encoded < state->pre_skip + state->samples);
+
+    /* Write all remaining pages */
+    __opus_encoder_write_pages(audio, state, 1);
+
+}
+
+void opus_encoder_free_handler(audio_stream* audio) {
+
+    /* Free encoder, if ever used */
+    if (audio->data != NULL)
+        __opus_encoder_state_free((opus_encoder_state*) audio->data);
+
+}
+
+/* Encoder handlers */
+audio_encoder _opus_encoder = {
+    .mimetype      = "audio/ogg; codecs=\"opus\"",
+    .begin_handler = opus_encoder_begin_handler,
+    .write_handler = opus_encoder_write_handler,
+    .end_handler   = opus_encoder_end_handler,
+    .free_handler  = opus_encoder_free_handler
+};
+
+/* Actual encoder */
+audio_encoder* opus_encoder = &_opus_encoder;
+
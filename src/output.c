@@ -0,0 +1,631 @@
+
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is libguac-client-rdp.
+ *
+ * The Initial Developer of the Original Code is
+ * Michael Jumper.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <guacamole/client.h>
+#include <guacamole/socket.h>
+
+#include "output.h"
+
+/**
+ * Sleeps until the given flag is cleared by the opposite side of the queue,
+ * or until the given condition no longer holds. The flag must be set before
+ * the condition is re-checked, such that a wakeup cannot be missed.
+ */
+#define __GUAC_RDP_OUTPUT_WAIT(output, flag, cond_expr)                  \
+    do {                                                                \
+        pthread_mutex_lock(&((output)->lock));                          \
+        (flag) = 1;                                                     \
+        __sync_synchronize();                                           \
+        while (cond_expr)                                               \
+            pthread_cond_wait(&((output)->cond), &((output)->lock));    \
+        (flag) = 0;                                                     \
+        pthread_mutex_unlock(&((output)->lock));                        \
+    } while (0)
+
+/**
+ * Wakes the opposite side of the queue if it is waiting, as indicated by the
+ * given flag.
+ */
+void __guac_rdp_output_wake(guac_rdp_output* output, volatile int* flag) {
+
+    /* Ensure updated head/tail is visible before checking flag */
+    __sync_synchronize();
+
+    if (*flag) {
+        pthread_mutex_lock(&(output->lock));
+        pthread_cond_broadcast(&(output->cond));
+        pthread_mutex_unlock(&(output->lock));
+    }
+
+}
+
+/**
+ * Waits until the given queue has free space within its ring buffer or, if
+ * boundary is non-zero, within its boundary ring. The writer thread is
+ * allowed to write the incomplete instruction filling this queue, and any
+ * data buffered within the sockets of other queues written by this same
+ * thread is flushed, as the writer thread may be waiting on the remainder of
+ * an instruction within that data.
+ */
+void __guac_rdp_output_wait(guac_rdp_output_queue* queue, int boundary) {
+
+    guac_rdp_output* output = queue->output;
+    int i;
+
+    queue->blocked = 1;
+
+    /* Queues already blocked are flushing further up this thread's stack */
+    if (queue->shared) {
+        for (i=0; i<GUAC_RDP_OUTPUT_PRIORITIES; i++) {
+            guac_rdp_output_queue* other = &(output->queues[i]);
+            if (other->shared && !other->blocked)
+                guac_socket_flush(other->socket);
+        }
+    }
+
+    __guac_rdp_output_wake(output, &(output->consumer_waiting));
+
+    if (boundary)
+        __GUAC_RDP_OUTPUT_WAIT(output, queue->producer_waiting,
+                queue->boundaries_head - queue->boundaries_tail
+                    == queue->boundaries_size);
+    else
+        __GUAC_RDP_OUTPUT_WAIT(output, queue->producer_waiting,
+                queue->head - queue->tail == queue->size);
+
+    queue->blocked = 0;
+
+}
+
+/**
+ * Records the given queue position as immediately following the end of a
+ * complete instruction, waiting for space within the boundary ring if
+ * necessary.
+ */
+void __guac_rdp_output_push_boundary(guac_rdp_output_queue* queue,
+        uint32_t position) {
+
+    guac_rdp_output* output = queue->output;
+    uint32_t head = queue->boundaries_head;
+
+    /* Wait for space if boundary ring is full */
+    if (head - queue->boundaries_tail == queue->boundaries_size)
+        __guac_rdp_output_wait(queue, 1);
+
+    queue->boundaries[head & (queue->boundaries_size - 1)] = position;
+
+    /* Publish boundary only after it is stored */
+    __sync_synchronize();
+    queue->boundaries_head = head + 1;
+
+    __guac_rdp_output_wake(output, &(output->consumer_waiting));
+
+}
+
+/**
+ * Scans the given data, which has just been written to the given queue
+ * starting at the given position, recording the end of each complete
+ * instruction. Each element of an instruction is prefixed with its length
+ * in characters, so the terminating semicolon of each instruction can be
+ * found without misinterpreting the contents of any element.
+ */
+void __guac_rdp_output_parse(guac_rdp_output_queue* queue,
+        const unsigned char* data, uint32_t length, uint32_t position) {
+
+    uint32_t i;
+
+    for (i=0; i<length; i++) {
+
+        unsigned char c = data[i];
+
+        /* Read length prefix until period */
+        if (!queue->parse_in_value) {
+            if (c == '.')
+                queue->parse_in_value = 1;
+            else
+                queue->parse_remaining =
+                    queue->parse_remaining * 10 + (c - '0');
+        }
+
+        /* Continuation bytes of UTF-8 characters are never terminators */
+        else if ((c & 0xC0) == 0x80)
+            continue;
+
+        /* Count characters of value */
+        else if (queue->parse_remaining > 0)
+            queue->parse_remaining--;
+
+        /* Otherwise, this is the terminator of the element */
+        else {
+
+            queue->parse_in_value = 0;
+            queue->parse_remaining = 0;
+
+            if (c == ';')
+                __guac_rdp_output_push_boundary(queue, position + i + 1);
+
+        }
+
+    }
+
+}
+
+ssize_t __guac_rdp_output_write_handler(guac_socket* socket,
+        const void* buf, size_t count) {
+
+    guac_rdp_output_queue* queue = (guac_rdp_output_queue*) socket->data;
+    guac_rdp_output* output = queue->output;
+
+    const unsigned char* data = (const unsigned char*) buf;
+    size_t remaining = count;
+
+    while (remaining > 0) {
+
+        uint32_t head = queue->head;
+        uint32_t space = queue->size - (head - queue->tail);
+        uint32_t offset = head & (queue->size - 1);
+        uint32_t length;
+
+        /* Wait for free space if queue is full */
+        if (space == 0) {
+            __guac_rdp_output_wait(queue, 0);
+            continue;
+        }
+
+        /* Copy as much as possible without wrapping */
+        length = space;
+        if (length > queue->size - offset)
+            length = queue->size - offset;
+        if (length > remaining)
+            length = remaining;
+
+        memcpy(queue->buffer + offset, data, length);
+
+        /* Publish data only after copy is complete */
+        __sync_synchronize();
+        queue->head = head + length;
+
+        /* Record any instructions completed by this data */
+        __guac_rdp_output_parse(queue, data, length, head);
+
+        data += length;
+        remaining -= length;
+
+        __guac_rdp_output_wake(output, &(output->consumer_waiting));
+
+    }
+
+    return count;
+
+}
+
+/**
+ * Returns the index of the queue the writer thread should write from next,
+ * or -1 if there is currently nothing which can be written. A queue
+ * containing a partially-written instruction must be finished first, and
+ * otherwise only complete instructions are written, highest priority first.
+ * If the producer of a queue containing no complete instruction is blocked
+ * on that queue, it is written regardless, as its instruction cannot
+ * otherwise be completed.
+ */
+int __guac_rdp_output_select(guac_rdp_output* output) {
+
+    int i;
+
+    /* Finish any partially-written instruction */
+    if (output->current != -1) {
+        guac_rdp_output_queue* queue = &(output->queues[output->current]);
+        return queue->head != queue->tail ? output->current : -1;
+    }
+
+    /* Otherwise, write complete instructions by priority */
+    for (i=0; i<GUAC_RDP_OUTPUT_PRIORITIES; i++) {
+        guac_rdp_output_queue* queue = &(output->queues[i]);
+        if (queue->boundaries_head != queue->boundaries_tail)
+            return i;
+    }
+
+    /* Write incomplete instruction only if it can progress no other way */
+    for (i=0; i<GUAC_RDP_OUTPUT_PRIORITIES; i++) {
+        guac_rdp_output_queue* queue = &(output->queues[i]);
+        if (queue->blocked && queue->head != queue->tail)
+            return i;
+    }
+
+    return -1;
+
+}
+
+/**
+ * Writes the given range of the given queue to the client's socket, unless
+ * writing has already failed.
+ */
+void __guac_rdp_output_write(guac_rdp_output* output,
+        guac_rdp_output_queue* queue, uint32_t start, uint32_t end) {
+
+    guac_socket* socket = output->client->socket;
+
+    while (start != end) {
+
+        /* Write all contiguous data */
+        uint32_t offset = start & (queue->size - 1);
+        uint32_t length = end - start;
+        if (length > queue->size - offset)
+            length = queue->size - offset;
+
+        /* Discard data if the socket has failed */
+        if (!output->failed) {
+            if (guac_socket_write(socket, queue->buffer + offset, length)) {
+                guac_client_log_error(output->client,
+                        "Error writing to client socket");
+                output->failed = 1;
+                guac_client_stop(output->client);
+            }
+            else
+                output->bytes_written += length;
+        }
+
+        start += length;
+
+    }
+
+}
+
+/**
+ * Returns whether the writer thread may stop writing due to a pause: it must
+ * be at an instruction boundary, and all data before the pause marks must
+ * have been written.
+ */
+int __guac_rdp_output_can_park(guac_rdp_output* output) {
+
+    int i;
+
+    if (!output->paused || output->stopping || output->current != -1)
+        return 0;
+
+    for (i=0; i<GUAC_RDP_OUTPUT_PRIORITIES; i++) {
+        if ((int32_t) (output->queues[i].tail - output->pause_marks[i]) < 0)
+            return 0;
+    }
+
+    return 1;
+
+}
+
+void* __guac_rdp_output_thread(void* data) {
+
+    guac_rdp_output* output = (guac_rdp_output*) data;
+    guac_socket* socket = output->client->socket;
+
+    for (;;) {
+
+        guac_rdp_output_queue* queue;
+        uint32_t tail;
+        uint32_t end;
+        uint32_t boundaries_tail;
+        int index;
+
+        /* Stop writing while paused, leaving the socket to guacd */
+        if (__guac_rdp_output_can_park(output)) {
+
+            if (!output->failed && guac_socket_flush(socket))
+                output->failed = 1;
+
+            pthread_mutex_lock(&(output->lock));
+
+            output->parked = 1;
+            pthread_cond_broadcast(&(output->cond));
+
+            while (__guac_rdp_output_can_park(output))
+                pthread_cond_wait(&(output->cond), &(output->lock));
+
+            output->parked = 0;
+            pthread_mutex_unlock(&(output->lock));
+            continue;
+
+        }
+
+        index = __guac_rdp_output_select(output);
+
+        /* If nothing can be written, flush and wait for data */
+        if (index == -1) {
+
+            if (!output->failed && guac_socket_flush(socket))
+                output->failed = 1;
+
+            /* Stop only once all complete instructions have been written,
+             * including any queued just before stopping was requested */
+            if (output->stopping) {
+                __sync_synchronize();
+                if (__guac_rdp_output_select(output) == -1)
+                    break;
+                continue;
+            }
+
+            __GUAC_RDP_OUTPUT_WAIT(output, output->consumer_waiting,
+                    __guac_rdp_output_select(output) == -1
+                    && !output->stopping
+                    && !__guac_rdp_output_can_park(output));
+            continue;
+
+        }
+
+        queue = &(output->queues[index]);
+        tail = queue->tail;
+        boundaries_tail = queue->boundaries_tail;
+
+        /* Ensure boundaries and data are read only after their heads */
+        __sync_synchronize();
+
+        /* Skip any boundaries already passed while writing an incomplete
+         * instruction, as each boundary is recorded only after its data */
+        while (boundaries_tail != queue->boundaries_head
+                && (int32_t) (queue->boundaries[boundaries_tail
+                    & (queue->boundaries_size - 1)] - tail) <= 0)
+            boundaries_tail++;
+
+        /* Write whole instructions, up to the write limit, if any are
+         * complete */
+        if (boundaries_tail != queue->boundaries_head) {
+
+            end = queue->boundaries[boundaries_tail++
+                & (queue->boundaries_size - 1)];
+
+            while (boundaries_tail != queue->boundaries_head) {
+
+                uint32_t next = queue->boundaries[boundaries_tail
+                    & (queue->boundaries_size - 1)];
+
+                if (next - tail > GUAC_RDP_OUTPUT_MAX_WRITE)
+                    break;
+
+                end = next;
+                boundaries_tail++;
+
+            }
+
+            output->current = -1;
+
+        }
+
+        /* Otherwise, write what exists of the incomplete instruction, if
+         * it must be written now */
+        else if (output->current == index || queue->blocked) {
+            end = queue->head;
+            output->current = index;
+            __sync_synchronize();
+        }
+
+        /* Nothing remained but boundaries already passed */
+        else
+            end = tail;
+
+        __guac_rdp_output_write(output, queue, tail, end);
+
+        /* Release space only after data has been read */
+        __sync_synchronize();
+        queue->tail = end;
+        queue->boundaries_tail = boundaries_tail;
+
+        __guac_rdp_output_wake(output, &(queue->producer_waiting));
+
+    }
+
+    return NULL;
+
+}
+
+/**
+ * Initializes the given queue of the given output, allocating its buffers
+ * and socket. If shared is non-zero, the queue is written by the same thread
+ * as all other queues initialized as shared.
+ */
+void __guac_rdp_output_queue_init(guac_rdp_output* output,
+        guac_rdp_output_queue* queue, uint32_t size,
+        uint32_t boundaries_size, int shared) {
+
+    queue->output = output;
+    queue->shared = shared;
+    queue->blocked = 0;
+    queue->producer_waiting = 0;
+    queue->size = size;
+    queue->buffer = malloc(size);
+    queue->head = 0;
+    queue->tail = 0;
+
+    queue->boundaries_size = boundaries_size;
+    queue->boundaries = malloc(boundaries_size * sizeof(uint32_t));
+    queue->boundaries_head = 0;
+    queue->boundaries_tail = 0;
+
+    queue->parse_in_value = 0;
+    queue->parse_remaining = 0;
+
+    /* Init queueing socket */
+    queue->socket = guac_socket_alloc();
+    queue->socket->data = queue;
+    queue->socket->write_handler = __guac_rdp_output_write_handler;
+
+}
+
+/**
+ * Frees the buffers and socket of the given queue.
+ */
+void __guac_rdp_output_queue_destroy(guac_rdp_output_queue* queue) {
+    guac_socket_free(queue->socket);
+    free(queue->boundaries);
+    free(queue->buffer);
+}
+
+guac_rdp_output* guac_rdp_output_alloc(guac_client* client) {
+
+    guac_rdp_output* output = malloc(sizeof(guac_rdp_output));
+    int i;
+
+    output->client = client;
+    output->current = -1;
+    output->consumer_waiting = 0;
+    output->paused = 0;
+    output->parked = 0;
+    output->stopping = 0;
+    output->failed = 0;
+    output->bytes_written = 0;
+
+    /* Init queues */
+    __guac_rdp_output_queue_init(output,
+            &(output->queues[GUAC_RDP_OUTPUT_AUDIO]),
+            GUAC_RDP_OUTPUT_PRIORITY_QUEUE_SIZE,
+            GUAC_RDP_OUTPUT_PRIORITY_BOUNDARIES, 0);
+
+    __guac_rdp_output_queue_init(output,
+            &(output->queues[GUAC_RDP_OUTPUT_CURSOR]),
+            GUAC_RDP_OUTPUT_PRIORITY_QUEUE_SIZE,
+            GUAC_RDP_OUTPUT_PRIORITY_BOUNDARIES, 1);
+
+    __guac_rdp_output_queue_init(output,
+            &(output->queues[GUAC_RDP_OUTPUT_IMAGE]),
+            GUAC_RDP_OUTPUT_QUEUE_SIZE,
+            GUAC_RDP_OUTPUT_BOUNDARIES, 1);
+
+    output->socket        = output->queues[GUAC_RDP_OUTPUT_IMAGE].socket;
+    output->cursor_socket = output->queues[GUAC_RDP_OUTPUT_CURSOR].socket;
+    output->audio_socket  = output->queues[GUAC_RDP_OUTPUT_AUDIO].socket;
+
+    pthread_mutex_init(&(output->lock), NULL);
+    pthread_cond_init(&(output->cond), NULL);
+
+    /* Start writer thread */
+    if (pthread_create(&(output->thread), NULL,
+                __guac_rdp_output_thread, output)) {
+        for (i=0; i<GUAC_RDP_OUTPUT_PRIORITIES; i++)
+            __guac_rdp_output_queue_destroy(&(output->queues[i]));
+        pthread_cond_destroy(&(output->cond));
+        pthread_mutex_destroy(&(output->lock));
+        free(output);
+        return NULL;
+    }
+
+    return output;
+
+}
+
+void guac_rdp_output_free(guac_rdp_output* output) {
+
+    int i;
+
+    /* Push out anything still buffered within the sockets */
+    for (i=0; i<GUAC_RDP_OUTPUT_PRIORITIES; i++)
+        guac_socket_flush(output->queues[i].socket);
+
+    /* Stop writer thread once all data is written */
+    output->stopping = 1;
+    pthread_mutex_lock(&(output->lock));
+    pthread_cond_broadcast(&(output->cond));
+    pthread_mutex_unlock(&(output->lock));
+    pthread_join(output->thread, NULL);
+
+    guac_client_log_info(output->client,
+            "Output queue wrote %lli bytes to client.",
+            (long long) output->bytes_written);
+
+    /* Free queues */
+    for (i=0; i<GUAC_RDP_OUTPUT_PRIORITIES; i++)
+        __guac_rdp_output_queue_destroy(&(output->queues[i]));
+
+    pthread_cond_destroy(&(output->cond));
+    pthread_mutex_destroy(&(output->lock));
+    free(output);
+
+}
+
+void guac_rdp_output_pause(guac_rdp_output* output, int drain) {
+
+    int i;
+
+    pthread_mutex_lock(&(output->lock));
+
+    /* Require either everything queued or only the current instruction to
+     * be written */
+    for (i=0; i<GUAC_RDP_OUTPUT_PRIORITIES; i++) {
+        guac_rdp_output_queue* queue = &(output->queues[i]);
+        output->pause_marks[i] = drain ? queue->head : queue->tail;
+    }
+
+    output->paused = 1;
+    pthread_cond_broadcast(&(output->cond));
+
+    /* A writer thread still parked from the previous pause resumes writing
+     * if it has not yet reached the new marks */
+    while (!(output->parked && __guac_rdp_output_can_park(output)))
+        pthread_cond_wait(&(output->cond), &(output->lock));
+
+    pthread_mutex_unlock(&(output->lock));
+
+}
+
+void guac_rdp_output_resume(guac_rdp_output* output) {
+    pthread_mutex_lock(&(output->lock));
+    output->paused = 0;
+    pthread_cond_broadcast(&(output->cond));
+    pthread_mutex_unlock(&(output->lock));
+}
+
+int guac_rdp_output_queued(guac_rdp_output* output) {
+
+    int queued = 0;
+    int i;
+
+    for (i=0; i<GUAC_RDP_OUTPUT_PRIORITIES; i++)
+        queued += output->queues[i].head - output->queues[i].tail;
+
+    return queued;
+
+}
+
+uint32_t guac_rdp_output_mark(guac_rdp_output* output) {
+    guac_socket_flush(output->socket);
+    return output->queues[GUAC_RDP_OUTPUT_IMAGE].head;
+}
+
+int guac_rdp_output_sent(guac_rdp_output* output, uint32_t mark) {
+    return (int32_t) (output->queues[GUAC_RDP_OUTPUT_IMAGE].tail - mark) >= 0;
+}
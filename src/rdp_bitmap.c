@@ -51,12 +51,14 @@
 #include <freerdp/codec/bitmap.h>
 
 #include "client.h"
+#include "guac_png.h"
 #include "rdp_bitmap.h"
 
 void guac_rdp_cache_bitmap(rdpContext* context, rdpBitmap* bitmap) {
 
     guac_client* client = ((rdp_freerdp_context*) context)->client;
-    guac_socket* socket = client->socket; 
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_socket* socket = data->output->socket;
 
     /* Allocate buffer */
     guac_layer* buffer = guac_client_alloc_buffer(client);
@@ -64,7 +66,6 @@ void guac_rdp_cache_bitmap(rdpContext* context, rdpBitmap* bitmap) {
     /* Cache image data if present */
     if (bitmap->data != NULL) {
 
-        rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
         pthread_mutex_lock(&(data->update_lock));
 
         /* Create surface from image data */
@@ -73,7 +74,7 @@ void guac_rdp_cache_bitmap(rdpContext* context, rdpBitmap* bitmap) {
             bitmap->width, bitmap->height, 4*bitmap->width);
 
         /* Send surface to buffer */
-        guac_protocol_send_png(socket,
+        guac_rdp_send_png(socket,
                 GUAC_COMP_SRC, buffer, 0, 0, surface);
 
         /* Free surface */
@@ -119,12 +120,12 @@ void guac_rdp_bitmap_new(rdpContext* context, rdpBitmap* bitmap) {
 void guac_rdp_bitmap_paint(rdpContext* context, rdpBitmap* bitmap) {
 
     guac_client* client = ((rdp_freerdp_context*) context)->client;
-    guac_socket* socket = client->socket;
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_socket* socket = data->output->socket;
 
     int width = bitmap->right - bitmap->left + 1;
     int height = bitmap->bottom - bitmap->top + 1;
 
-    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
     pthread_mutex_lock(&(data->update_lock));
 
     /* If not cached, cache if necessary */
@@ -149,7 +150,7 @@ void guac_rdp_bitmap_paint(rdpContext* context, rdpBitmap* bitmap) {
             width, height, 4*bitmap->width);
 
         /* Send surface to buffer */
-        guac_protocol_send_png(socket,
+        guac_rdp_send_png(socket,
                 GUAC_COMP_OVER, GUAC_DEFAULT_LAYER,
                 bitmap->left, bitmap->top, surface);
 
@@ -36,6 +36,8 @@
  * ***** END LICENSE BLOCK ***** */
 
 
+#include <pthread.h>
+
 #include <freerdp/freerdp.h>
 #include <freerdp/channels/channels.h>
 #include <freerdp/utils/event.h>
@@ -182,6 +184,8 @@ void guac_rdp_process_cb_data_request(guac_client* client,
 void guac_rdp_process_cb_data_response(guac_client* client,
         RDP_CB_DATA_RESPONSE_EVENT* event) {
 
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+
     /* Received clipboard data */
     if (event->data[event->size - 1] == '\0') {
 
@@ -193,7 +197,10 @@ void guac_rdp_process_cb_data_response(guac_client* client,
             strdup((char*) event->data);
 
         /* Send clipboard data */
-        guac_protocol_send_clipboard(client->socket, (char*) event->data);
+        pthread_mutex_lock(&(data->update_lock));
+        guac_protocol_send_clipboard(data->output->socket,
+                (char*) event->data);
+        pthread_mutex_unlock(&(data->update_lock));
 
     }
     else
@@ -42,6 +42,8 @@
 #include <guacamole/client.h>
 
 #include "client.h"
+#include "flow_control.h"
+#include "guac_png.h"
 #include "rdp_bitmap.h"
 
 guac_transfer_function guac_rdp_rop3_transfer_function(guac_client* client,
@@ -108,6 +110,8 @@ void guac_rdp_gdi_dstblt(rdpContext* context, DSTBLT_ORDER* dstblt) {
     const guac_layer* current_layer = ((rdp_guac_client_data*) client->data)->current_surface;
 
     rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_socket* socket = data->output->socket;
+
     pthread_mutex_lock(&(data->update_lock));
 
     switch (dstblt->bRop) {
@@ -116,11 +120,11 @@ void guac_rdp_gdi_dstblt(rdpContext* context, DSTBLT_ORDER* dstblt) {
         case 0:
 
             /* Send black rectangle */
-            guac_protocol_send_rect(client->socket, current_layer,
+            guac_protocol_send_rect(socket, current_layer,
                     dstblt->nLeftRect, dstblt->nTopRect,
                     dstblt->nWidth, dstblt->nHeight);
 
-            guac_protocol_send_cfill(client->socket,
+            guac_protocol_send_cfill(socket,
                     GUAC_COMP_OVER, current_layer,
                     0, 0, 0, 255);
 
@@ -155,6 +159,9 @@ void guac_rdp_gdi_patblt(rdpContext* context, PATBLT_ORDER* patblt) {
     const guac_layer* current_layer =
         ((rdp_guac_client_data*) client->data)->current_surface;
 
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_socket* socket = data->output->socket;
+
     /* Layer for actual transfer */
     guac_layer* buffer;
 
@@ -165,16 +172,18 @@ void guac_rdp_gdi_patblt(rdpContext* context, PATBLT_ORDER* patblt) {
     guac_client_log_info(client, "Using fallback PATBLT (server is ignoring "
             "negotiated client capabilities)");
 
+    pthread_mutex_lock(&(data->update_lock));
+
     /* Render rectangle based on ROP */
     switch (patblt->bRop) {
 
         /* If blackness, send black rectangle */
         case 0x00:
-            guac_protocol_send_rect(client->socket, current_layer,
+            guac_protocol_send_rect(socket, current_layer,
                     patblt->nLeftRect, patblt->nTopRect,
                     patblt->nWidth, patblt->nHeight);
 
-            guac_protocol_send_cfill(client->socket,
+            guac_protocol_send_cfill(socket,
                     GUAC_COMP_OVER, current_layer,
                     0x00, 0x00, 0x00, 0xFF);
             break;
@@ -186,11 +195,11 @@ void guac_rdp_gdi_patblt(rdpContext* context, PATBLT_ORDER* patblt) {
         /* If operation is just a copy, send foreground only */
         case 0xCC:
         case 0xF0:
-            guac_protocol_send_rect(client->socket, current_layer,
+            guac_protocol_send_rect(socket, current_layer,
                     patblt->nLeftRect, patblt->nTopRect,
                     patblt->nWidth, patblt->nHeight);
 
-            guac_protocol_send_cfill(client->socket,
+            guac_protocol_send_cfill(socket,
                     GUAC_COMP_OVER, current_layer,
                     (patblt->foreColor >> 16) & 0xFF,
                     (patblt->foreColor >> 8 ) & 0xFF,
@@ -200,11 +209,11 @@ void guac_rdp_gdi_patblt(rdpContext* context, PATBLT_ORDER* patblt) {
 
         /* If whiteness, send white rectangle */
         case 0xFF:
-            guac_protocol_send_rect(client->socket, current_layer,
+            guac_protocol_send_rect(socket, current_layer,
                     patblt->nLeftRect, patblt->nTopRect,
                     patblt->nWidth, patblt->nHeight);
 
-            guac_protocol_send_cfill(client->socket,
+            guac_protocol_send_cfill(socket,
                     GUAC_COMP_OVER, current_layer,
                     0xFF, 0xFF, 0xFF, 0xFF);
             break;
@@ -216,15 +225,15 @@ void guac_rdp_gdi_patblt(rdpContext* context, PATBLT_ORDER* patblt) {
             buffer = guac_client_alloc_buffer(client);
 
             /* Send rectangle stroke */
-            guac_protocol_send_rect(client->socket, buffer,
+            guac_protocol_send_rect(socket, buffer,
                     0, 0, patblt->nWidth, patblt->nHeight);
 
             /* Fill rectangle with fore color only */
-            guac_protocol_send_cfill(client->socket, GUAC_COMP_OVER, buffer,
+            guac_protocol_send_cfill(socket, GUAC_COMP_OVER, buffer,
                     0xFF, 0xFF, 0xFF, 0xFF);
 
             /* Transfer */
-            guac_protocol_send_transfer(client->socket,
+            guac_protocol_send_transfer(socket,
 
                     /* ... from buffer */
                     buffer, 0, 0, patblt->nWidth, patblt->nHeight,
@@ -240,6 +249,8 @@ void guac_rdp_gdi_patblt(rdpContext* context, PATBLT_ORDER* patblt) {
 
     }
 
+    pthread_mutex_unlock(&(data->update_lock));
+
 }
 
 void guac_rdp_gdi_scrblt(rdpContext* context, SCRBLT_ORDER* scrblt) {
@@ -248,10 +259,12 @@ void guac_rdp_gdi_scrblt(rdpContext* context, SCRBLT_ORDER* scrblt) {
     const guac_layer* current_layer = ((rdp_guac_client_data*) client->data)->current_surface;
     
     rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_socket* socket = data->output->socket;
+
     pthread_mutex_lock(&(data->update_lock));
 
     /* Copy screen rect to current surface */
-    guac_protocol_send_copy(client->socket,
+    guac_protocol_send_copy(socket,
             GUAC_DEFAULT_LAYER,
             scrblt->nXSrc, scrblt->nYSrc, scrblt->nWidth, scrblt->nHeight,
             GUAC_COMP_OVER, current_layer,
@@ -265,21 +278,21 @@ void guac_rdp_gdi_memblt(rdpContext* context, MEMBLT_ORDER* memblt) {
 
     guac_client* client = ((rdp_freerdp_context*) context)->client;
     const guac_layer* current_layer = ((rdp_guac_client_data*) client->data)->current_surface;
-    guac_socket* socket = client->socket;
     guac_rdp_bitmap* bitmap = (guac_rdp_bitmap*) memblt->bitmap;
 
     rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_socket* socket = data->output->socket;
     pthread_mutex_lock(&(data->update_lock));
 
     switch (memblt->bRop) {
 
         /* If blackness, send black rectangle */
         case 0x00:
-            guac_protocol_send_rect(client->socket, current_layer,
+            guac_protocol_send_rect(socket, current_layer,
                     memblt->nLeftRect, memblt->nTopRect,
                     memblt->nWidth, memblt->nHeight);
 
-            guac_protocol_send_cfill(client->socket,
+            guac_protocol_send_cfill(socket,
                     GUAC_COMP_OVER, current_layer,
                     0x00, 0x00, 0x00, 0xFF);
             break;
@@ -308,7 +321,7 @@ void guac_rdp_gdi_memblt(rdpContext* context, MEMBLT_ORDER* memblt) {
                         4*memblt->bitmap->width);
 
                     /* Send surface to buffer */
-                    guac_protocol_send_png(socket,
+                    guac_rdp_send_png(socket,
                             GUAC_COMP_OVER, current_layer,
                             memblt->nLeftRect, memblt->nTopRect, surface);
 
@@ -334,11 +347,11 @@ void guac_rdp_gdi_memblt(rdpContext* context, MEMBLT_ORDER* memblt) {
 
         /* If whiteness, send white rectangle */
         case 0xFF:
-            guac_protocol_send_rect(client->socket, current_layer,
+            guac_protocol_send_rect(socket, current_layer,
                     memblt->nLeftRect, memblt->nTopRect,
                     memblt->nWidth, memblt->nHeight);
 
-            guac_protocol_send_cfill(client->socket,
+            guac_protocol_send_cfill(socket,
                     GUAC_COMP_OVER, current_layer,
                     0xFF, 0xFF, 0xFF, 0xFF);
             break;
@@ -376,13 +389,15 @@ void guac_rdp_gdi_opaquerect(rdpContext* context, OPAQUE_RECT_ORDER* opaque_rect
     const guac_layer* current_layer = ((rdp_guac_client_data*) client->data)->current_surface;
 
     rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_socket* socket = data->output->socket;
+
     pthread_mutex_lock(&(data->update_lock));
 
-    guac_protocol_send_rect(client->socket, current_layer,
+    guac_protocol_send_rect(socket, current_layer,
             opaque_rect->nLeftRect, opaque_rect->nTopRect,
             opaque_rect->nWidth, opaque_rect->nHeight);
 
-    guac_protocol_send_cfill(client->socket,
+    guac_protocol_send_cfill(socket,
             GUAC_COMP_OVER, current_layer,
             (color >> 16) & 0xFF,
             (color >> 8 ) & 0xFF,
@@ -407,19 +422,21 @@ void guac_rdp_gdi_set_bounds(rdpContext* context, rdpBounds* bounds) {
     const guac_layer* current_layer = ((rdp_guac_client_data*) client->data)->current_surface;
 
     rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_socket* socket = data->output->socket;
+
     pthread_mutex_lock(&(data->update_lock));
 
     /* Reset clip */
-    guac_protocol_send_reset(client->socket, current_layer);
+    guac_protocol_send_reset(socket, current_layer);
 
     /* Set clip if specified */
     if (bounds != NULL) {
-        guac_protocol_send_rect(client->socket, current_layer,
+        guac_protocol_send_rect(socket, current_layer,
                 bounds->left, bounds->top,
                 bounds->right - bounds->left + 1,
                 bounds->bottom - bounds->top + 1);
 
-        guac_protocol_send_clip(client->socket, current_layer);
+        guac_protocol_send_clip(socket, current_layer);
     }
 
     pthread_mutex_unlock(&(data->update_lock));
@@ -427,7 +444,22 @@ void guac_rdp_gdi_set_bounds(rdpContext* context, rdpBounds* bounds) {
 }
 
 void guac_rdp_gdi_end_paint(rdpContext* context) {
+
     guac_client* client = ((rdp_freerdp_context*) context)->client;
-    guac_socket_flush(client->socket);
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    int motion_delay;
+
+    /* Send frame, or combine with later updates if not yet due */
+    guac_rdp_flow_end_frame(client);
+
+    /* Send any input received while this update was handled, rather than
+     * holding it until all received updates have been handled */
+    motion_delay = guac_rdp_input_queue_drain(&(data->input_queue),
+            context->instance, data->rdp_fd);
+
+    /* Wake to send coalesced mouse motion once allowed */
+    if (motion_delay >= 0)
+        guac_rdp_event_loop_schedule(&(data->event_loop), motion_delay);
+
 }
 
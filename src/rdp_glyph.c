@@ -43,6 +43,7 @@
 #include <guacamole/error.h>
 
 #include "client.h"
+#include "guac_png.h"
 #include "rdp_glyph.h"
 
 void guac_rdp_glyph_new(rdpContext* context, rdpGlyph* glyph) {
@@ -228,7 +229,7 @@ void guac_rdp_glyph_enddraw(rdpContext* context,
             width, height, stride);
 
     /* Send surface with all glyphs to layer */
-    guac_protocol_send_png(client->socket,
+    guac_rdp_send_png(guac_client_data->output->socket,
             GUAC_COMP_OVER, current_layer, x, y,
             surface);
 
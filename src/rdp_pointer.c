@@ -37,30 +37,97 @@
  * ***** END LICENSE BLOCK ***** */
 
 #include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
 #include <freerdp/freerdp.h>
 
 #include <guacamole/client.h>
 
 #include "client.h"
+#include "guac_png.h"
 #include "rdp_pointer.h"
 #include "default_pointer.h"
 
+/**
+ * Calculates the 64-bit FNV-1a hash of the given image data.
+ */
+uint64_t __guac_rdp_pointer_hash(const unsigned char* data, int length) {
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    while (length > 0) {
+        hash ^= *(data++);
+        hash *= 0x100000001B3ULL;
+        length--;
+    }
+
+    return hash;
+
+}
+
+/**
+ * Sends a cursor instruction using the given layer. Cursor instructions are
+ * sent through the cursor queue, ahead of queued images, unless the image
+ * data they depend on (or a previous cursor instruction) is still queued, in
+ * which case they are sent in order with that image data.
+ */
+void __guac_rdp_pointer_send_cursor(rdp_guac_client_data* data,
+        int x, int y, const guac_layer* layer, int width, int height) {
+
+    guac_rdp_output* output = data->output;
+
+    /* Send through cursor queue only if nothing depended upon is queued */
+    if (guac_rdp_output_sent(output, data->pointer_mark)) {
+        guac_protocol_send_cursor(output->cursor_socket, x, y, layer,
+                0, 0, width, height);
+        guac_socket_flush(output->cursor_socket);
+    }
+
+    /* Otherwise, send in order, requiring later cursors to follow */
+    else {
+        guac_protocol_send_cursor(output->socket, x, y, layer,
+                0, 0, width, height);
+        data->pointer_mark = guac_rdp_output_mark(output);
+    }
+
+}
+
+void guac_rdp_pointer_cache_init(guac_rdp_pointer_cache_entry* cache) {
+    memset(cache, 0,
+            sizeof(guac_rdp_pointer_cache_entry) * GUAC_RDP_POINTER_CACHE_SIZE);
+}
+
+void guac_rdp_pointer_cache_free(guac_rdp_pointer_cache_entry* cache) {
+
+    int i;
+
+    for (i=0; i<GUAC_RDP_POINTER_CACHE_SIZE; i++)
+        free(cache[i].data);
+
+    guac_rdp_pointer_cache_init(cache);
+
+}
+
 void guac_rdp_pointer_new(rdpContext* context, rdpPointer* pointer) {
 
     guac_client* client = ((rdp_freerdp_context*) context)->client;
-    guac_socket* socket = client->socket;
+    rdp_guac_client_data* client_data = (rdp_guac_client_data*) client->data;
+    guac_socket* socket = client_data->output->socket;
 
-    /* Allocate data for image */
-    unsigned char* data =
-        (unsigned char*) malloc(pointer->width * pointer->height * 4);
+    guac_rdp_pointer_cache_entry* cache = client_data->pointer_cache;
+    guac_rdp_pointer_cache_entry* free_entry = NULL;
 
-    /* Allocate layer */
-    guac_layer* buffer = guac_client_alloc_buffer(client);
+    int length = pointer->width * pointer->height * 4;
+    uint64_t hash;
+    int i;
 
-    cairo_surface_t* surface;
+    /* Allocate data for image */
+    unsigned char* data = (unsigned char*) malloc(length);
+    memset(data, 0, length);
 
-    rdp_guac_client_data* client_data = (rdp_guac_client_data*) client->data;
-    pthread_mutex_lock(&(client_data->update_lock));
+    guac_layer* buffer;
+    cairo_surface_t* surface;
 
     /* Convert to alpha cursor if mask data present */
     if (pointer->andMaskData && pointer->xorMaskData)
@@ -69,17 +136,69 @@ void guac_rdp_pointer_new(rdpContext* context, rdpPointer* pointer) {
                 pointer->width, pointer->height, pointer->xorBpp,
                 ((rdp_freerdp_context*) context)->clrconv);
 
+    /* Identify image by content */
+    hash = __guac_rdp_pointer_hash(data, length);
+
+    pthread_mutex_lock(&(client_data->update_lock));
+
+    /* Reuse existing buffer if identical image already uploaded */
+    for (i=0; i<GUAC_RDP_POINTER_CACHE_SIZE; i++) {
+
+        guac_rdp_pointer_cache_entry* entry = &(cache[i]);
+
+        /* Remember first unused entry in case image is not found */
+        if (entry->layer == NULL) {
+            if (free_entry == NULL)
+                free_entry = entry;
+            continue;
+        }
+
+        if (entry->hash   == hash
+         && entry->width  == pointer->width
+         && entry->height == pointer->height
+         && memcmp(entry->data, data, length) == 0) {
+
+            entry->refcount++;
+            ((guac_rdp_pointer*) pointer)->layer = entry->layer;
+
+            pthread_mutex_unlock(&(client_data->update_lock));
+            free(data);
+            return;
+
+        }
+
+    }
+
+    /* Allocate layer */
+    buffer = guac_client_alloc_buffer(client);
+
     /* Create surface from image data */
     surface = cairo_image_surface_create_for_data(
         data, CAIRO_FORMAT_ARGB32,
         pointer->width, pointer->height, 4*pointer->width);
 
     /* Send surface to buffer */
-    guac_protocol_send_png(socket, GUAC_COMP_SRC, buffer, 0, 0, surface);
+    guac_rdp_send_png(socket, GUAC_COMP_SRC, buffer, 0, 0, surface);
+
+    /* Cursor instructions using this buffer must follow its image data */
+    client_data->pointer_mark = guac_rdp_output_mark(client_data->output);
 
     /* Free surface */
     cairo_surface_destroy(surface);
-    free(data);
+
+    /* Cache buffer and image data if room remains */
+    if (free_entry != NULL) {
+        free_entry->hash     = hash;
+        free_entry->data     = data;
+        free_entry->width    = pointer->width;
+        free_entry->height   = pointer->height;
+        free_entry->layer    = buffer;
+        free_entry->refcount = 1;
+    }
+
+    /* Otherwise, image data is no longer needed */
+    else
+        free(data);
 
     /* Remember buffer */
     ((guac_rdp_pointer*) pointer)->layer = buffer;
@@ -90,15 +209,14 @@ void guac_rdp_pointer_new(rdpContext* context, rdpPointer* pointer) {
 void guac_rdp_pointer_set(rdpContext* context, rdpPointer* pointer) {
 
     guac_client* client = ((rdp_freerdp_context*) context)->client;
-    guac_socket* socket = client->socket;
-
     rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+
     pthread_mutex_lock(&(data->update_lock));
 
     /* Set cursor */
-    guac_protocol_send_cursor(socket, pointer->xPos, pointer->yPos,
+    __guac_rdp_pointer_send_cursor(data, pointer->xPos, pointer->yPos,
             ((guac_rdp_pointer*) pointer)->layer,
-            0, 0, pointer->width, pointer->height);
+            pointer->width, pointer->height);
 
     pthread_mutex_unlock(&(data->update_lock));
 }
@@ -106,15 +224,69 @@ void guac_rdp_pointer_set(rdpContext* context, rdpPointer* pointer) {
 void guac_rdp_pointer_free(rdpContext* context, rdpPointer* pointer) {
 
     guac_client* client = ((rdp_freerdp_context*) context)->client;
-    guac_client_free_buffer(client, ((guac_rdp_pointer*) pointer)->layer);
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+    guac_layer* layer = ((guac_rdp_pointer*) pointer)->layer;
+
+    int i;
+
+    pthread_mutex_lock(&(data->update_lock));
+
+    /* If cached, release reference, freeing buffer only if last reference */
+    for (i=0; i<GUAC_RDP_POINTER_CACHE_SIZE; i++) {
+
+        guac_rdp_pointer_cache_entry* entry = &(data->pointer_cache[i]);
+
+        if (entry->layer == layer) {
+
+            /* Free buffer and entry if no longer used */
+            if (--entry->refcount == 0) {
+                guac_client_free_buffer(client, layer);
+                free(entry->data);
+                entry->data = NULL;
+                entry->layer = NULL;
+            }
+
+            pthread_mutex_unlock(&(data->update_lock));
+            return;
+
+        }
+
+    }
+
+    /* Otherwise, buffer is not shared */
+    guac_client_free_buffer(client, layer);
+
+    pthread_mutex_unlock(&(data->update_lock));
 
 }
 
 void guac_rdp_pointer_set_null(rdpContext* context) {
-    /* STUB */
+
+    guac_client* client = ((rdp_freerdp_context*) context)->client;
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+
+    pthread_mutex_lock(&(data->update_lock));
+
+    /* Set cursor to transparent pixel */
+    __guac_rdp_pointer_send_cursor(data, 0, 0, data->null_pointer, 1, 1);
+
+    pthread_mutex_unlock(&(data->update_lock));
+
 }
 
 void guac_rdp_pointer_set_default(rdpContext* context) {
-    /* STUB */
+
+    guac_client* client = ((rdp_freerdp_context*) context)->client;
+    rdp_guac_client_data* data = (rdp_guac_client_data*) client->data;
+
+    pthread_mutex_lock(&(data->update_lock));
+
+    /* Set cursor to embedded default pointer */
+    __guac_rdp_pointer_send_cursor(data, 0, 0, data->default_pointer,
+            guac_rdp_default_pointer_width,
+            guac_rdp_default_pointer_height);
+
+    pthread_mutex_unlock(&(data->update_lock));
+
 }
 
@@ -35,8 +35,6 @@
  *
  * ***** END LICENSE BLOCK ***** */
 
-#define WAV_BUFFER_SIZE 0x4000
-
 #include <stdlib.h>
 #include <string.h>
 
@@ -48,16 +46,18 @@
 
 void wav_encoder_begin_handler(audio_stream* audio) {
 
-    /* Allocate stream state */
-    wav_encoder_state* state = (wav_encoder_state*)
-        malloc(sizeof(wav_encoder_state));
+    wav_encoder_state* state = (wav_encoder_state*) audio->data;
 
-    /* Initialize buffer */
-    state->length = WAV_BUFFER_SIZE;
-    state->used = 0;
-    state->data_buffer = (unsigned char*) malloc(state->length);
+    /* Allocate stream state once, reusing it for all chunks */
+    if (state == NULL) {
+        state = (wav_encoder_state*) malloc(sizeof(wav_encoder_state));
+        audio->data = state;
+    }
 
-    audio->data = state;
+    /* Reserve space for headers, written once the data size is known */
+    state->used = 0;
+    state->header_offset = audio->encoded_data_used;
+    audio_stream_reserve_encoded(audio, WAV_HEADER_SIZE);
 
 }
 
@@ -103,6 +103,9 @@ void wav_encoder_end_handler(audio_stream* audio) {
     /* Get state */
     wav_encoder_state* state = (wav_encoder_state*) audio->data;
 
+    /* Headers are written into the space reserved when the chunk began */
+    unsigned char* header = audio->encoded_data + state->header_offset;
+
     /*
      * RIFF HEADER
      */
@@ -112,9 +115,8 @@ void wav_encoder_end_handler(audio_stream* audio) {
             4 + sizeof(fmt_header) + sizeof(data_header) + state->used,
             sizeof(riff_header.chunk_size));
 
-    audio_stream_write_encoded(audio,
-            (unsigned char*) &riff_header,
-            sizeof(riff_header));
+    memcpy(header, &riff_header, sizeof(riff_header));
+    header += sizeof(riff_header);
 
     /*
      * FMT HEADER
@@ -142,9 +144,8 @@ void wav_encoder_end_handler(audio_stream* audio) {
     _wav_encoder_write_le(fmt_header.subchunk_bps,
             audio->bps, sizeof(fmt_header.subchunk_bps));
 
-    audio_stream_write_encoded(audio,
-            (unsigned char*) &fmt_header,
-            sizeof(fmt_header));
+    memcpy(header, &fmt_header, sizeof(fmt_header));
+    header += sizeof(fmt_header);
 
     /*
      * DATA HEADER
@@ -154,15 +155,14 @@ void wav_encoder_end_handler(audio_stream* audio) {
     _wav_encoder_write_le(data_header.subchunk_size,
             state->used, sizeof(data_header.subchunk_size));
 
-    audio_stream_write_encoded(audio,
-            (unsigned char*) &data_header,
-            sizeof(data_header));
+    memcpy(header, &data_header, sizeof(data_header));
 
-    /* Write .wav data */
-    audio_stream_write_encoded(audio, state->data_buffer, state->used);
+}
+
+void wav_encoder_free_handler(audio_stream* audio) {
 
-    /* Free stream state */
-    free(state);
+    /* Free stream state, if ever allocated */
+    free(audio->data);
 
 }
 
@@ -172,18 +172,8 @@ void wav_encoder_write_handler(audio_stream* audio,
     /* Get state */
     wav_encoder_state* state = (wav_encoder_state*) audio->data;
 
-    /* Increase size of buffer if necessary */
-    if (state->used + length > state->length) {
-
-        /* Increase to double concatenated size to accomodate */
-        state->length = (state->length + length)*2;
-        state->data_buffer = realloc(state->data_buffer,
-                state->length);
-
-    }
-
-    /* Append to buffer */
-    memcpy(&(state->data_buffer[state->used]), pcm_data, length);
+    /* PCM data is stored as-is, directly following the headers */
+    audio_stream_write_encoded(audio, pcm_data, length);
     state->used += length;
 
 }
@@ -193,7 +183,8 @@ audio_encoder _wav_encoder = {
     .mimetype      = "audio/wav",
     .begin_handler = wav_encoder_begin_handler,
     .write_handler = wav_encoder_write_handler,
-    .end_handler   = wav_encoder_end_handler
+    .end_handler   = wav_encoder_end_handler,
+    .free_handler  = wav_encoder_free_handler
 };
 
 /* Actual encoder */